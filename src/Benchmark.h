@@ -0,0 +1,528 @@
+#pragma once
+#include "Core/Common.h"
+#include "Core/ImageBuffer.h"
+#include "Core/Scene.h"
+#include "ReverseWoS.h"
+#include "ForwardWoS.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Micro benchmarks, none of them run by default. Call them from main.
+
+inline double SecondsSince(std::chrono::system_clock::time_point start)
+{
+	std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+	return elapsed_seconds.count();
+}
+
+// std::log based Green(R, l) against GreenKernel on squared distances,
+// then the splat throughput of DrawGreenSphere for a few disk sizes
+void RunGreenKernelBenchmark(int evaluations = 1 << 24)
+{
+	XoshiroSampler sampler;
+	sampler.StartWalk(0, 0);
+	const double R = 0.5;
+	std::vector<double> l2(1 << 16);
+	sampler.Fill1D(l2.data(), (int)l2.size());
+	for (auto& v : l2) { v *= R * R; }
+	const int mask = int(l2.size()) - 1;
+
+	double sum = 0.0;
+	auto start = std::chrono::system_clock::now();
+	for (int i = 0; i < evaluations; ++i) {
+		sum += Green(R, std::sqrt(l2[i & mask]));
+	}
+	double time_log = SecondsSince(start);
+
+	GreenKernel kernel(R);
+	double sum_kernel = 0.0;
+	start = std::chrono::system_clock::now();
+	for (int i = 0; i < evaluations; ++i) {
+		sum_kernel += kernel(l2[i & mask]);
+	}
+	double time_kernel = SecondsSince(start);
+
+	double max_error = 0.0;
+	for (double v : l2) {
+		max_error = max(max_error, std::abs(Green(R, std::sqrt(v)) - kernel(v)));
+	}
+
+	std::cout << "Green(R, l):   " << evaluations / time_log / 1e6 << " M evaluations/s" << std::endl;
+	std::cout << "GreenKernel:   " << evaluations / time_kernel / 1e6 << " M evaluations/s" << std::endl;
+	std::cout << "Max abs error: " << max_error << " (checksum " << sum - sum_kernel << ")" << std::endl;
+
+	ImageBuffer buffer(DefaultResolution);
+	for (double r : { 0.001, 0.01, 0.1, 0.5 }) {
+		int splats = max(16, int(2e8 * buffer.pixel_size * buffer.pixel_size / (r * r)) / 100);
+		start = std::chrono::system_clock::now();
+		for (int i = 0; i < splats; ++i) {
+			Vec2 pos = sampler.Next2D() - Vec2(0.5, 0.5);
+			buffer.DrawGreenSphere(pos, r, Vec3{ 1.0, 1.0, 1.0 }, sampler);
+		}
+		double t = SecondsSince(start);
+		double pixels = splats * volume(r) / (buffer.pixel_size * buffer.pixel_size);
+		std::cout << "DrawGreenSphere r=" << r << ": " << splats / t << " splats/s, "
+			<< pixels / t / 1e6 << " M pixels/s" << std::endl;
+	}
+}
+
+// L1 data cache read misses and last level cache misses of the calling thread, from the
+// Linux perf counters (there is no generic L2 event). Counts are -1 where the counters
+// are not available: other systems, VMs without a PMU or a strict perf_event_paranoid.
+class CacheMissCounter
+{
+public:
+	CacheMissCounter()
+	{
+#ifdef __linux__
+		fd_l1 = Open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+		fd_llc = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#endif
+	}
+
+	~CacheMissCounter()
+	{
+#ifdef __linux__
+		if (fd_l1 >= 0) { close(fd_l1); }
+		if (fd_llc >= 0) { close(fd_llc); }
+#endif
+	}
+
+	void Start()
+	{
+#ifdef __linux__
+		for (int fd : { fd_l1, fd_llc }) {
+			if (fd < 0) { continue; }
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+
+	void Stop()
+	{
+#ifdef __linux__
+		l1 = Read(fd_l1);
+		llc = Read(fd_llc);
+#endif
+	}
+
+	long long l1 = -1;
+	long long llc = -1;
+
+private:
+#ifdef __linux__
+	static int Open(unsigned int type, unsigned long long config)
+	{
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+
+	static long long Read(int fd)
+	{
+		if (fd < 0) { return -1; }
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		long long count = -1;
+		if (read(fd, &count, sizeof(count)) != sizeof(count)) { return -1; }
+		return count;
+	}
+#endif
+
+	int fd_l1 = -1;
+	int fd_llc = -1;
+};
+
+// Row major, tiled and sparse pixels on SourceScene and BoundaryScene. The same reverse
+// walks are run into a buffer of each layout, which is then reduced (scaled by a constant,
+// as NormalizeBuffer does) to compare memory and reduction time. Then only splats are
+// replayed, with DrawGreenSphere on random disks of the radius distribution of the walks.
+void RunPixelLayoutBenchmark(int samples = 20000)
+{
+	const int layout_count = 3;
+	const PixelLayout layouts[] = { PixelLayout::RowMajor, PixelLayout::Tiled, PixelLayout::Sparse };
+	const char* layout_names[] = { "row major", "tiled", "sparse" };
+
+	auto report = [&](const string& what, int layout, double t, double count, const CacheMissCounter& counter) {
+		std::cout << what << " " << layout_names[layout] << ": " << t << " s, " << count / t << " /s";
+		if (counter.l1 >= 0) { std::cout << ", L1D misses " << counter.l1 / count; }
+		if (counter.llc >= 0) { std::cout << ", LLC misses " << counter.llc / count; }
+		std::cout << (counter.l1 < 0 && counter.llc < 0 ? " (no cache counters)" : " per item") << std::endl;
+	};
+
+	for (int scene = 0; scene < 2; ++scene) {
+		PoissonEquation equation = scene == 0 ? SourceScene() : BoundaryScene(true);
+		string scene_name = scene == 0 ? "SourceScene" : "BoundaryScene";
+
+		std::vector<ImageBuffer> results;
+		for (int layout = 0; layout < layout_count; ++layout) {
+			ReverseWoSSolver solver;
+			solver.SourceSamples = samples;
+			solver.BoundarySamples = samples;
+			ImageBuffer buffer(DefaultResolution, layouts[layout]);
+
+			CacheMissCounter counter;
+			counter.Start();
+			auto start = std::chrono::system_clock::now();
+			solver.Solve(equation, &buffer, 0);
+			buffer.ResolveSplats();
+			double t = SecondsSince(start);
+			counter.Stop();
+			report(scene_name + " walks", layout, t, 2.0 * samples, counter);
+
+			start = std::chrono::system_clock::now();
+			for (int repeat = 0; repeat < 10; ++repeat) {
+				buffer.ForEachStoredPixel([&](int index) {
+					buffer.SetColor(index, buffer.GetColor(index) * 0.5);
+				});
+			}
+			std::cout << scene_name << " reduction " << layout_names[layout] << ": " << SecondsSince(start) / 10
+				<< " s, " << buffer.PixelBytes() / 1048576.0 << " MB of pixels" << std::endl;
+			results.push_back(buffer);
+		}
+
+		// Same walks, so the layouts must agree exactly
+		double max_diff = 0.0;
+		for (int layout = 1; layout < layout_count; ++layout) {
+			for (int y = 0; y < DefaultResolution; ++y) {
+				for (int x = 0; x < DefaultResolution; ++x) {
+					Vec3 a = results[0].GetColor(results[0].PixelIndex(x, y));
+					Vec3 b = results[layout].GetColor(results[layout].PixelIndex(x, y));
+					max_diff = max(max_diff, (a - b).cwiseAbs().maxCoeff());
+				}
+			}
+		}
+		std::cout << scene_name << " max difference between layouts: " << max_diff << std::endl;
+	}
+
+	// Splats alone, radii log uniform between 1 and 64 pixels as for most walk steps
+	const int splats = 200000;
+	for (int layout = 0; layout < layout_count; ++layout) {
+		XoshiroSampler sampler;
+		sampler.StartWalk(0, 0);
+		ImageBuffer buffer(DefaultResolution, layouts[layout]);
+		CacheMissCounter counter;
+		counter.Start();
+		auto start = std::chrono::system_clock::now();
+		for (int i = 0; i < splats; ++i) {
+			Vec2 pos = (2.0 * sampler.Next2D() - Vec2(1.0, 1.0)) * ScreenSize;
+			double r = buffer.pixel_size * std::exp(sampler.Next1D() * std::log(64.0));
+			buffer.DrawGreenSphere(pos, r, Vec3{ 1.0, 1.0, 1.0 }, sampler);
+		}
+		double t = SecondsSince(start);
+		counter.Stop();
+		report("Splats", layout, t, splats, counter);
+	}
+}
+
+// Uniform numbers per second through the Sampler interface, walks of dimensions numbers
+// each restarting the sampler, against one std::mt19937 with a uniform_real_distribution
+void RunSamplerBenchmark(int walks = 1 << 20, int dimensions = 16)
+{
+	double checksum = 0.0;
+	std::mt19937 mt(0);
+	std::uniform_real_distribution<> uniform(0.0, 1.0);
+	auto start = std::chrono::system_clock::now();
+	for (int i = 0; i < walks * dimensions; ++i) { checksum += uniform(mt); }
+	double t = SecondsSince(start);
+	std::cout << "mt19937 (" << sizeof(mt) << " bytes): " << walks * dimensions / t / 1e6 << " M numbers/s" << std::endl;
+
+	const char* names[] = { "Philox", "Xoshiro" };
+	const SamplerType types[] = { SamplerType::Philox, SamplerType::Xoshiro };
+	std::vector<double> values(dimensions);
+	for (int k = 0; k < 2; ++k) {
+		std::unique_ptr<Sampler> sampler = MakeSampler(types[k]);
+		start = std::chrono::system_clock::now();
+		for (int walk = 0; walk < walks; ++walk) {
+			sampler->StartWalk(1, walk);
+			for (int d = 0; d < dimensions; ++d) { checksum += sampler->Next1D(); }
+		}
+		double t1 = SecondsSince(start);
+
+		start = std::chrono::system_clock::now();
+		for (int walk = 0; walk < walks; ++walk) {
+			sampler->StartWalk(1, walk);
+			sampler->Fill1D(values.data(), dimensions);
+			checksum += values[0];
+		}
+		double t2 = SecondsSince(start);
+		std::cout << names[k] << ": " << walks * dimensions / t1 / 1e6 << " M numbers/s by Next1D, "
+			<< walks * dimensions / t2 / 1e6 << " M numbers/s by Fill1D" << std::endl;
+	}
+	std::cout << "(checksum " << checksum << ")" << std::endl;
+}
+
+// Forward WoS with samples walks per pixel, uniform against adaptive (PilotSamples = 4),
+// on the bundled scenes at a small resolution. Errors are RMS over the pixels against a
+// uniform reference of referenceSamples walks. Equal time RMSE scales the adaptive error
+// to the time of the uniform run, the MSE falling as 1 / time.
+void RunAdaptiveSamplingBenchmark(int resolution = 96, int samples = 32, int referenceSamples = 1024)
+{
+	ThreadPool pool(1);
+	Window window(resolution);
+	const char* scene_names[] = { "BoundaryScene", "BugDiffusionCurve", "SourceScene" };
+
+	for (int scene = 0; scene < 3; ++scene) {
+		PoissonEquation equation = scene == 0 ? BoundaryScene(true) : scene == 1 ? BugDiffusionCurve() : SourceScene();
+		ForwardWoSSolver solver;
+		solver.m_Window = window;
+
+		ImageBuffer reference(window);
+		solver.PixelSamples = referenceSamples;
+		solver.Solve(equation, &reference, 1000);
+
+		auto rmse = [&](const ImageBuffer& img) {
+			double sum = 0.0;
+			for (int index = 0; index < img.PixelCount(); ++index) {
+				sum += (img.GetColor(index) - reference.GetColor(index)).squaredNorm() / 3.0;
+			}
+			return sqrt(sum / img.PixelCount());
+		};
+
+		ImageBuffer uniform(window);
+		solver.PixelSamples = samples;
+		auto start = std::chrono::system_clock::now();
+		solver.Solve(equation, &uniform, 0);
+		double t_uniform = SecondsSince(start);
+
+		ImageBuffer adaptive(window);
+		std::vector<int> walks;
+		solver.PilotSamples = 4;
+		solver.AdaptiveSamples = samples;
+		start = std::chrono::system_clock::now();
+		solver.SampleAdaptive(equation, adaptive, pool, walks);
+		double t_adaptive = SecondsSince(start);
+
+		double e_uniform = rmse(uniform), e_adaptive = rmse(adaptive);
+		std::cout << scene_names[scene] << " uniform: " << t_uniform << " s, RMSE " << e_uniform << std::endl;
+		std::cout << scene_names[scene] << " adaptive: " << t_adaptive << " s, RMSE " << e_adaptive
+			<< ", equal time RMSE " << e_adaptive * sqrt(t_adaptive / t_uniform) << std::endl;
+	}
+}
+
+// Error against sample count of the scrambled Sobol sampler and of Philox, forward walks
+// per pixel and reverse walks per estimate on BoundaryScene and SourceScene at a small
+// resolution. Errors are RMS over the pixels against a Philox reference of referenceScale
+// times the largest count, averaged over repeats estimates. Pseudo random errors fall as
+// 1 / sqrt(samples), the QMC ones faster where the low dimensions dominate the variance.
+void RunQMCBenchmark(int resolution = 64, int repeats = 4, int referenceScale = 16)
+{
+	Window window(resolution);
+	const char* sampler_names[] = { "Philox", "Sobol" };
+	const SamplerType types[] = { SamplerType::Philox, SamplerType::Sobol };
+
+	for (int scene = 0; scene < 2; ++scene) {
+		PoissonEquation equation = scene == 0 ? BoundaryScene(true) : SourceScene();
+		string scene_name = scene == 0 ? "BoundaryScene" : "SourceScene";
+
+		auto rmse = [](const ImageBuffer& img, const ImageBuffer& reference) {
+			double sum = 0.0;
+			for (int index = 0; index < img.PixelCount(); ++index) {
+				sum += (img.GetColor(index) - reference.GetColor(index)).squaredNorm() / 3.0;
+			}
+			return sqrt(sum / img.PixelCount());
+		};
+
+		// Forward, samples walks per pixel
+		{
+			ForwardWoSSolver solver;
+			solver.m_Window = window;
+			const int counts[] = { 1, 4, 16, 64 };
+
+			ImageBuffer reference(window);
+			solver.PixelSamples = counts[3] * referenceScale;
+			solver.Solve(equation, &reference, 1000);
+
+			for (int samples : counts) {
+				std::cout << scene_name << " forward " << samples << " spp:";
+				for (int k = 0; k < 2; ++k) {
+					solver.Generator = types[k];
+					solver.PixelSamples = samples;
+					double error = 0.0;
+					for (int repeat = 0; repeat < repeats; ++repeat) {
+						ImageBuffer img(window);
+						solver.Solve(equation, &img, repeat);
+						error += rmse(img, reference) / repeats;
+					}
+					std::cout << " " << sampler_names[k] << " RMSE " << error;
+				}
+				std::cout << std::endl;
+			}
+		}
+
+		// Reverse, samples source and boundary walks
+		{
+			ReverseWoSSolver solver;
+			const int counts[] = { 1000, 4000, 16000 };
+
+			ImageBuffer reference(window);
+			solver.SourceSamples = solver.BoundarySamples = counts[2] * referenceScale;
+			solver.Solve(equation, &reference, 1000);
+			reference.ResolveSplats();
+
+			for (int samples : counts) {
+				std::cout << scene_name << " reverse " << samples << " walks:";
+				for (int k = 0; k < 2; ++k) {
+					solver.Generator = types[k];
+					solver.SourceSamples = solver.BoundarySamples = samples;
+					double error = 0.0;
+					for (int repeat = 0; repeat < repeats; ++repeat) {
+						ImageBuffer img(window);
+						solver.Solve(equation, &img, repeat);
+						img.ResolveSplats();
+						error += rmse(img, reference) / repeats;
+					}
+					std::cout << " " << sampler_names[k] << " RMSE " << error;
+				}
+				std::cout << std::endl;
+			}
+		}
+	}
+}
+
+// Walks per second of the scalar walks against WavefrontWalks of a few widths and WalkPacket
+// of 4, 8 and 16 lanes, forward at samples walks per pixel and reverse with walks source and
+// boundary walks, on one thread. Every time is the best of repeats runs. Also the largest
+// difference of the two images relative to the largest value, which is only rounding.
+// Build for AVX2 and for AVX-512 (-mavx2 -mfma, -march=native) to compare the packets.
+void RunWavefrontBenchmark(int resolution = 128, int samples = 8, int walks = 20000, int repeats = 3)
+{
+	Window window(resolution);
+	const int widths[] = { 256, 1024, 4096 };
+	const char* scene_names[] = { "BoundaryScene", "BugDiffusionCurve", "SourceScene" };
+
+	auto difference = [](const ImageBuffer& a, const ImageBuffer& b) {
+		double diff = 0.0, scale = 0.0;
+		for (int index = 0; index < a.PixelCount(); ++index) {
+			diff = max(diff, (a.GetColor(index) - b.GetColor(index)).cwiseAbs().maxCoeff());
+			scale = max(scale, a.GetColor(index).cwiseAbs().maxCoeff());
+		}
+		return scale > 0.0 ? diff / scale : diff;
+	};
+
+	for (int scene = 0; scene < 3; ++scene) {
+		PoissonEquation equation = scene == 0 ? BoundaryScene(true) : scene == 1 ? BugDiffusionCurve() : SourceScene();
+
+		// Best time of repeats solves into a fresh image, which is returned in result
+		auto best = [&](Solver& solver, ImageBuffer& result) {
+			double t = std::numeric_limits<double>::infinity();
+			for (int repeat = 0; repeat < repeats; ++repeat) {
+				ImageBuffer img(window);
+				auto start = std::chrono::system_clock::now();
+				solver.Solve(equation, &img, 0);
+				img.ResolveSplats();
+				t = min(t, SecondsSince(start));
+				result = img;
+			}
+			return t;
+		};
+
+		ForwardWoSSolver forward;
+		forward.m_Window = window;
+		forward.PixelSamples = samples;
+		ReverseWoSSolver reverse;
+		reverse.SourceSamples = walks;
+		reverse.BoundarySamples = walks;
+		const double forwardWalks = (double)window.width * window.height * samples;
+		const double reverseWalks = (equation.Source->HasSource() ? walks : 0) + (equation.Boundary->HasBoundaryValue() ? walks : 0);
+
+		ImageBuffer forwardScalar(window), reverseScalar(window);
+		double tf = best(forward, forwardScalar), tr = best(reverse, reverseScalar);
+		std::cout << scene_names[scene] << " scalar: forward " << forwardWalks / tf << " walks/s, reverse "
+			<< reverseWalks / tr << " walks/s" << std::endl;
+
+		auto compare = [&](const string& engine) {
+			ImageBuffer forwardImage(window), reverseImage(window);
+			double wf = best(forward, forwardImage), wr = best(reverse, reverseImage);
+			std::cout << scene_names[scene] << " " << engine << ": forward " << forwardWalks / wf << " walks/s ("
+				<< tf / wf << "x, difference " << difference(forwardScalar, forwardImage) << "), reverse "
+				<< reverseWalks / wr << " walks/s (" << tr / wr << "x, difference " << difference(reverseScalar, reverseImage)
+				<< ")" << std::endl;
+		};
+
+		for (int width : widths) {
+			forward.Wavefront = reverse.Wavefront = true;
+			forward.WavefrontWidth = reverse.WavefrontWidth = width;
+			compare("wavefront " + std::to_string(width));
+			forward.Wavefront = reverse.Wavefront = false;
+		}
+		for (int width : { 4, 8, 16 }) {
+			forward.PacketWidth = reverse.PacketWidth = width;
+			compare("packet " + std::to_string(width));
+			forward.PacketWidth = reverse.PacketWidth = 0;
+		}
+	}
+}
+
+// Closest point queries of walk on spheres steps with and without a WalkQueryContext: the BVH nodes
+// fcpw visits and the time per query, best of repeats. The steps of forward walks from the pixels
+// are recorded first and then queried again, so both take the same points in the same order.
+void RunQueryContextBenchmark(int resolution = 64, int samples = 4, int repeats = 3)
+{
+	Window window(resolution);
+	const char* scene_names[] = { "BoundaryScene", "BugDiffusionCurve", "SourceScene" };
+	const double epsilon = ForwardWoSSolver().m_Epsilon;
+
+	for (int scene = 0; scene < 3; ++scene) {
+		PoissonEquation equation = scene == 0 ? BoundaryScene(true) : scene == 1 ? BugDiffusionCurve() : SourceScene();
+		const Boundary& boundary = *equation.Boundary;
+		ImageBuffer buffer(window);
+
+		std::vector<std::vector<Vec2>> walks;
+		PhiloxSampler sampler;
+		for (int j = 0; j < window.height; ++j) {
+			for (int i = 0; i < window.width; ++i) {
+				for (int sample = 0; sample < samples; ++sample) {
+					sampler.StartWalk(0, Solver::WalkIndex(j * window.width + i, sample));
+					std::vector<Vec2> steps;
+					Vec2 p = buffer.img2world({ i, j });
+					for (int step = 0; step < Solver::MaxPathLength; ++step) {
+						steps.push_back(p);
+						double r = boundary.GetClosestPoint(p).distance;
+						if (r < epsilon || r > 5.0 * ScreenSize) { break; }
+						p = Uniform_dB(p, r, sampler).pos;
+					}
+					walks.push_back(steps);
+				}
+			}
+		}
+
+		// Reset before every query makes every query start from scratch, as GetClosestPoint(p)
+		double sum = 0.0;
+		auto run = [&](bool reset, WalkQueryContext& stats) {
+			double t = std::numeric_limits<double>::infinity();
+			for (int repeat = 0; repeat < repeats; ++repeat) {
+				WalkQueryContext context;
+				auto start = std::chrono::system_clock::now();
+				for (const auto& steps : walks) {
+					context.Reset();
+					for (const Vec2& p : steps) {
+						if (reset) { context.Reset(); }
+						sum += boundary.GetClosestPoint(p, context).distance;
+					}
+				}
+				t = min(t, SecondsSince(start));
+				stats = context;
+			}
+			return t * 1e9 / stats.queries;
+		};
+
+		WalkQueryContext fresh, carried;
+		double t_fresh = run(true, fresh), t_carried = run(false, carried);
+		std::cout << scene_names[scene] << ": " << fresh.queries << " queries, nodes visited "
+			<< (double)fresh.nodesVisited / fresh.queries << " -> " << (double)carried.nodesVisited / carried.queries
+			<< " per query, " << t_fresh << " -> " << t_carried << " ns per query" << std::endl;
+	}
+}
@@ -62,6 +62,67 @@ ClosePoint Boundary::GetClosestPoint(const Vec2& p) const {
 	return cp;
 }
 
+// A walk step goes from the previous query point to a point of its sphere, so the previous closest
+// point is at most the previous distance plus the step away, 2r for a step of walk on spheres, and
+// the search of fcpw is bounded by that from the root. The bound is padded for the float arithmetic of
+// fcpw, and a search that finds nothing within it is repeated without one. The direction to the
+// previous closest point goes in as the boundary hint, which the BVHs of this fcpw do not use yet.
+// The search is not started from the leaf of the previous closest point: fcpw only searches the
+// subtree of the start node, and a probe of that leaf ahead of the search costs more than it prunes.
+ClosePoint Boundary::GetClosestPoint(const Vec2& p, WalkQueryContext& context) const
+{
+	fcpw::Vector3 x{ (float)p[0], (float)p[1], 0.f };
+	fcpw::Interaction<3> interaction;
+	bool found = false;
+	int visited = 0;
+	if (context.valid) {
+		double bound = (context.distance + (p - context.position).norm()) * 1.0001 + 1e-6;
+		Vec2 toClosest = context.closest - p;
+		fcpw::Vector3 hint{ (float)toClosest[0], (float)toClosest[1], 0.f };
+		fcpw::BoundingSphere<3> sphere(x, (float)(bound * bound));
+		found = m_Aggregate->findClosestPointFromNode(sphere, interaction, 0, m_Aggregate->index, hint, visited);
+	}
+	if (!found) {
+		interaction = fcpw::Interaction<3>();
+		fcpw::BoundingSphere<3> sphere(x, fcpw::maxFloat);
+		m_Aggregate->findClosestPointFromNode(sphere, interaction, 0, m_Aggregate->index, fcpw::Vector3::Zero(), visited);
+	}
+
+	ClosePoint cp;
+	cp.position = Vec2{ interaction.p[0], interaction.p[1] };
+	cp.distance = interaction.d;
+
+	context.valid = true;
+	context.position = p;
+	context.closest = cp.position;
+	context.distance = cp.distance;
+	++context.queries;
+	context.nodesVisited += visited;
+	return cp;
+}
+
+// The closest point of the previous point is at most its distance plus the gap between the two
+// points away, which bounds the search of fcpw. Consecutive points are usually close, so fcpw
+// skips the nodes beyond the bound from the start. The bound is padded for the float arithmetic of fcpw, and a search
+// that finds nothing within it is repeated without one.
+void Boundary::GetClosestDistances(const Vec2* points, int count, double* distances) const
+{
+	for (int i = 0; i < count; ++i) {
+		fcpw::Vector3 p{ (float)points[i][0], (float)points[i][1], 0.f };
+		fcpw::Interaction<3> interaction;
+		bool found = false;
+		if (i > 0) {
+			double bound = (distances[i - 1] + (points[i] - points[i - 1]).norm()) * 1.0001 + 1e-6;
+			found = m_Scene.findClosestPoint(p, interaction, (float)(bound * bound));
+		}
+		if (!found) {
+			interaction = fcpw::Interaction<3>();
+			m_Scene.findClosestPoint(p, interaction);
+		}
+		distances[i] = interaction.d;
+	}
+}
+
 bool Boundary::CheckInterior(const Vec2& p) const
 {
 	bool sign = false;
@@ -77,9 +138,9 @@ bool Boundary::CheckInterior(const Vec2& p) const
 	return sign;
 }
 
-BoundaryVauleSample Boundary::SampleBoundary(std::mt19937& gen, double& pdf) const {
+BoundaryVauleSample Boundary::SampleBoundary(Sampler& sampler, double& pdf) const {
 	Vec2 pos, n;
-	double r = Rand01(gen) * m_len;
+	double r = sampler.Next1D() * m_len;
 	double len = 0.0;
 	double side = 1.0;
 	for (int i = 0; i < m_Index.size(); i+=2) {
@@ -18,6 +18,22 @@ struct BoundaryData
 	std::vector<int>  index;
 };
 
+// What the closest point query of a walk step knows from the step before it, see
+// Boundary::GetClosestPoint(p, context). One per walk, Reset when the walk starts.
+struct WalkQueryContext
+{
+	bool valid = false;	// Whether there was a previous step
+	Vec2 position;		// The previous query point
+	Vec2 closest;		// and its closest point
+	double distance = 0.0;
+
+	// Statistics over all queries since the context was made
+	long long queries = 0;
+	long long nodesVisited = 0;
+
+	void Reset() { valid = false; }
+};
+
 class Boundary {
 public: 
 	static std::shared_ptr<Boundary> GetImageBoundary()
@@ -56,6 +72,12 @@ public:
 
 	ClosePoint GetClosestPoint(const Vec2& p) const;
 
+	// Same closest point, but the search starts from what context kept of the previous step
+	ClosePoint GetClosestPoint(const Vec2& p, WalkQueryContext& context) const;
+
+	// Distances of count points to the boundary, in the order given, see WavefrontWalks
+	void GetClosestDistances(const Vec2* points, int count, double* distances) const;
+
 	// Return true if p is inside the boundary
 	bool CheckInterior(const Vec2& p) const;
 
@@ -64,12 +86,13 @@ public:
 	virtual Vec3 BoundaryValue(const Vec2& p) const { return { 0.0, 0.0, 0.0 }; }
 
 	// Uniform sample
-	virtual BoundaryVauleSample SampleBoundary(std::mt19937& gen, double& pdf) const;
+	virtual BoundaryVauleSample SampleBoundary(Sampler& sampler, double& pdf) const;
 
 protected:
 	std::vector<Vec2> m_Points;
 	std::vector<int>  m_Index;
 	fcpw::Scene<3> m_Scene;
+	const fcpw::Aggregate<3>* m_Aggregate = nullptr;
 
 	// If we just do uniform sample over boundary
 	double m_pdf;
@@ -98,6 +121,7 @@ protected:
 			m_Scene.setObjectLineSegment(a, i / 2, 0);
 		}
 		m_Scene.build(fcpw::AggregateType::Bvh_OverlapSurfaceArea, true);
+		m_Aggregate = m_Scene.getSceneData()->aggregate.get();
 	}
 };
 
@@ -147,12 +171,12 @@ public:
 
 
 	// Importance sampling according to the vertex colors
-	BoundaryVauleSample SampleBoundary(std::mt19937& gen, double& pdf) const override {
+	BoundaryVauleSample SampleBoundary(Sampler& sampler, double& pdf) const override {
 		if (!m_ImportanceSampling)
 		{
 			Vec2 pos, n;
 			Vec3 col;
-			double r = Rand01(gen) * m_len;
+			double r = sampler.Next1D() * m_len;
 			double len = 0.0;
 			
 			for (int i = 0; i < m_Index.size(); i += 2) {
@@ -168,7 +192,7 @@ public:
 					col = BoundaryValue(pos); // :( lazy
 #else
 					double t = 1 - (r - len) / ab;
-					bool sign = Rand01(gen) > 0.5;
+					bool sign = sampler.Next1D() > 0.5;
 					n = sign ? -n : n;
 					col = ColorHelper(i / 2, { t, sign });
 #endif
@@ -185,7 +209,7 @@ public:
 			Vec2 pos, n;
 			Vec3 col;
 
-			double sample_energy = Rand01(gen) * m_TotalEnergy;
+			double sample_energy = sampler.Next1D() * m_TotalEnergy;
 			double col_sum = 0.0;
 			double len = 0.0;
 			for (int i = 0; i < m_Index.size(); i += 2) {
@@ -207,7 +231,7 @@ public:
 #ifdef  SINGLE_SIDE
 					col = BoundaryValue(pos); // :( lazy
 #else
-					bool sign = Rand01(gen) > 0.5;
+					bool sign = sampler.Next1D() > 0.5;
 					n = sign ? -n : n;
 					col = ColorHelper(i / 2, {t, sign});
 #endif //  SINGLE_SIDE
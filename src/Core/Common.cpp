@@ -1,4 +1,14 @@
 #include "Common.h"
 
 std::random_device rd;
-std::uniform_real_distribution<> UniformDistribution(0.0, 1.0);
\ No newline at end of file
+
+FastLogTable::FastLogTable()
+{
+	for (int k = 0; k <= 256; ++k) {
+		double c = 1.0 + k / 256.0;
+		log_c[k] = std::log(c);
+		inv_c[k] = 1.0 / c;
+	}
+}
+
+const FastLogTable LogTable;
\ No newline at end of file
@@ -7,13 +7,22 @@
 #include <random>
 #include <thread>
 #include <string>
+#include <cstring>
+#include <cstdint>
+#include <limits>
 
 #include <chrono>
 #include <ctime>    
 #include <iomanip>
 
+#include "Sampler.h"
+
 #define UniformInPixel 1
 
+// Splats accumulate in float partial sums that are flushed into the double image,
+// which halves the memory traffic of the splat loops (see ImageBuffer::SplatReal)
+// #define FLOAT_ACCUMULATION 1
+
 using namespace std;
 using namespace Eigen;
 
@@ -30,17 +39,12 @@ constexpr double TwoPI =  2 * PI;
 constexpr int DefaultResolution = 900;
 
 extern std::random_device rd;
-extern std::uniform_real_distribution<> UniformDistribution;
 
 
 inline double clamp(double v, double a, double b) {
 	return min(max(a, v), b);
 }
 
-inline double Rand01(std::mt19937& gen) {
-	return UniformDistribution(gen);
-}
-
 
 inline double ToGrey(Vec3 c) { return (c[0] + c[1] + c[2]) / 3; }
 inline double perimeter(double r) { return 2.0 * PI * r; }
@@ -56,10 +60,64 @@ inline double FundamentalSolution(double r) {
 // r = |x - y|
 inline double Green(double R, double r) 
 {
-	assert(R > r);
+	assert(R >= r);
 	return std::log(R / r) / TwoPI;
 }
 
+// log(1 + k / 256) and 1 / (1 + k / 256) for k = 0..256, filled in Common.cpp
+struct FastLogTable
+{
+	FastLogTable();
+
+	double log_c[257];
+	double inv_c[257];
+};
+
+extern const FastLogTable LogTable;
+
+// Natural log for positive doubles, about twice as fast as std::log.
+// x = m * 2^e with m in [1, 2). The top 9 mantissa bits pick the nearest table entry
+// c = 1 + k / 256, and log(m) = log(c) + log(1 + u) with u = m / c - 1, |u| <= 1/512.
+// log(1 + u) is cut after u^4, which bounds the absolute error by |u|^5 / 5 < 6e-15.
+// Zero and subnormal inputs are not handled, callers clamp to DBL_MIN first.
+inline double FastLog(double x)
+{
+	uint64_t bits;
+	std::memcpy(&bits, &x, sizeof(double));
+	int e = int((bits >> 52) & 0x7ff) - 1023;
+	int k = int((bits >> 44) & 0xff) + int((bits >> 43) & 1);
+
+	// Force the exponent to zero, giving m in [1, 2)
+	bits = (bits & 0x000fffffffffffffull) | 0x3ff0000000000000ull;
+	double m;
+	std::memcpy(&m, &bits, sizeof(double));
+
+	double u = m * LogTable.inv_c[k] - 1.0;
+	double log1p = u * (1.0 + u * (-0.5 + u * (1.0 / 3 - u * 0.25)));
+	return e * 0.6931471805599453 + LogTable.log_c[k] + log1p;
+}
+
+// Green's function of a disk of radius R evaluated from squared distances:
+// G(R, l) = log(R / l) / 2pi = -log(l^2 / R^2) / 4pi.
+// All per-disk constants are computed once here, so evaluating the kernel costs a
+// multiply, two clamps and a FastLog. R and l2 only need to be in the same units.
+// l = 0 is clamped to the smallest normal double instead of returning inf,
+// l >= R returns 0 as the kernel vanishes on the boundary.
+struct GreenKernel
+{
+	GreenKernel(double R, double scale = 1.0)
+		: invR2(1.0 / (R * R)), factor(-scale / (2.0 * TwoPI)) {}
+
+	inline double operator()(double l2) const
+	{
+		double t = min(max(l2 * invR2, std::numeric_limits<double>::min()), 1.0);
+		return factor * FastLog(t);
+	}
+
+	double invR2;
+	double factor;
+};
+
 // Green function for disk {x^2 + y^2 < R^2}
 // Remember put x to be 0 if needed
 inline double Green(Vec2 x, Vec2 y, double R)
@@ -92,17 +150,18 @@ struct SamplePoint {
 	double pdf;
 };
 
-inline SamplePoint Uniform_dB(Vec2 center, double r, std::mt19937& gen) 
+inline SamplePoint Uniform_dB(Vec2 center, double r, Sampler& sampler) 
 {
-	double theta = TwoPI * Rand01(gen);
+	double theta = TwoPI * sampler.Next1D();
 	Vec2 point = center + r * Vec2(cos(theta), sin(theta));
 	return SamplePoint{ point, 1.0 / perimeter(r) };
 }
 
-inline SamplePoint Uniform_Ball(Vec2 center, double r, std::mt19937& gen) 
+inline SamplePoint Uniform_Ball(Vec2 center, double r, Sampler& sampler) 
 {
-	double theta =  TwoPI * Rand01(gen);
-	double sample_r = r * sqrt(1 - Rand01(gen));
+	Vec2 u = sampler.Next2D();
+	double theta =  TwoPI * u[0];
+	double sample_r = r * sqrt(1 - u[1]);
 	Vec2 point = center + sample_r * Vec2(cos(theta), sin(theta));
 	return { point, 1.0 / volume(r) };
 }
@@ -120,10 +179,11 @@ inline float productLogMinus1(float x)
     return w;
 }
 
-inline SamplePoint SampleGreen(Vec2 pos, float R, std::mt19937& gen) {
-	double x0 = Rand01(gen);
+inline SamplePoint SampleGreen(Vec2 pos, float R, Sampler& sampler) {
+	Vec2 u = sampler.Next2D();
+	double x0 = u[0];
 	float r = R * std::sqrt(-x0 / productLogMinus1(-x0 / 2.718282f));
-	float phi = Rand01(gen) * TwoPI;
+	float phi = u[1] * TwoPI;
 	Vec2 p(r * std::cos(phi), r * std::sin(phi));
 	double pdf = Green(R, r) / (R * R / 4.0f);
 	return { pos + p, pdf };
@@ -0,0 +1,188 @@
+#pragma once
+#include "Common.h"
+#include "FFT.h"
+#include <mutex>
+#include <memory>
+
+// One Green's disk whose splat is postponed to the end of the batch
+struct SplatEvent
+{
+	double cx, cy;    // Center in pixel units, sample points sit at integer coordinates
+	double R;         // Radius in pixels
+	Vec3 color;       // Color amplitude of the kernel
+	double weight;    // Amplitude of the Poisson kernel weight channel
+	bool countWeight; // The weight channel gets 1 per covered pixel instead of weight * G
+};
+
+// Deferred splatting for reverse WoS. Every splat is the same radial kernel G(R, .)
+// scaled by a color, so walks only record events and Resolve draws all of them at once:
+// events are binned by radius, deposited bilinearly as impulses into a grid per bin and
+// convolved with the kernel of the bin by FFT. Per batch this costs O(bins N^2 log N)
+// for an N x N padded grid instead of O(R^2) per splat.
+//
+// Error: bin b holds radii within a factor 2^(1/BinsPerOctave) around R_b. Inside min(R, R_b)
+// G(R, l) = G(R_b, l) + log(R / R_b) / 2pi, so each event also deposits a constant d into an
+// indicator disk of radius R_b. d = (R^2 - R_b^2) / (4pi R_b^2) rather than log(R / R_b) / 2pi
+// keeps the integral of every splat exact (R^2 / 4), which removes the mean bias of the binning
+// at the cost of an offset of (log(R / R_b))^2 / 2pi (< 0.0012 at 4 bins per octave) inside.
+// The rest of the error is in the annulus between R and R_b, of relative width up to
+// 2^(1/(2 BinsPerOctave)) - 1 (9% at 4 bins per octave), where |G| <= log(2) / (4pi BinsPerOctave).
+// The count weight is exact inside min(R, R_b) and only misses or adds that annulus.
+// The bilinear center deposit adds the error of interpolating G over one pixel, as for the pyramid.
+//
+// Memory is five N x N complex grids while resolving, N = 2048 at 900 pixels (320 MB).
+class DeferredSplatter
+{
+public:
+	// Radii in pixels handled here, smaller disks are cheaper to draw directly
+	int MinRadius = 0;
+	int MaxRadius = 0;
+	int BinsPerOctave = 4;
+
+	// side is the larger dimension of the image
+	void Enable(int side, int minRadius, int binsPerOctave)
+	{
+		MinRadius = minRadius;
+		MaxRadius = max(minRadius, side / 2);
+		BinsPerOctave = binsPerOctave;
+	}
+
+	bool Accepts(double R) const { return MinRadius > 0 && R >= MinRadius && R <= MaxRadius; }
+
+	// Pixels around the center a resolved splat of radius R can reach
+	double SupportRadius(double R) const { return BinRadius(Bin(R)) + 2.0; }
+
+	void EnableConcurrentWrites() { lock = std::make_shared<std::mutex>(); }
+
+	void Record(const SplatEvent& e)
+	{
+		if (lock) {
+			std::lock_guard<std::mutex> guard(*lock);
+			events.push_back(e);
+		} else {
+			events.push_back(e);
+		}
+	}
+
+	size_t EventCount() const { return events.size(); }
+
+	// Add every recorded splat into a width x height RGBW image, pixel(x, y) returning the
+	// channels of a pixel or null to skip it, and drop the events
+	template <typename P>
+	void Resolve(int width, int height, P pixel)
+	{
+		if (events.empty()) { return; }
+
+		std::sort(events.begin(), events.end(), [](const SplatEvent& a, const SplatEvent& b) { return a.R < b.R; });
+
+		// Bins sharing a grid size accumulate their spectra and are transformed back together
+		std::unique_ptr<FFT> fft;
+		std::vector<Complex> kernel, x1, x2, y1, y2;
+		int offset_x = 0, offset_y = 0;
+
+		auto flush = [&]() {
+			if (!fft) { return; }
+			int N = fft->n;
+			fft->Transform2D(y1, true);
+			fft->Transform2D(y2, true);
+			for (int y = 0; y < height; ++y) {
+				for (int x = 0; x < width; ++x) {
+					double* v = pixel(x, y);
+					if (!v) { continue; }
+					const Complex& a = y1[(y + offset_y) * N + x + offset_x];
+					const Complex& b = y2[(y + offset_y) * N + x + offset_x];
+					v[0] += a.real();
+					v[1] += a.imag();
+					v[2] += b.real();
+					v[3] += b.imag();
+				}
+			}
+		};
+
+		for (size_t begin = 0; begin < events.size(); ) {
+			int bin = Bin(events[begin].R);
+			size_t end = begin;
+			while (end < events.size() && Bin(events[end].R) == bin) { ++end; }
+
+			double Rb = BinRadius(bin);
+			int support = (int)std::ceil(Rb);
+			int N = FFT::NextPowerOfTwo(max(width, height) + 2 * (support + 2));
+			if (!fft || fft->n != N) {
+				flush();
+				fft.reset(new FFT(N));
+				offset_x = (N - width) / 2;
+				offset_y = (N - height) / 2;
+				y1.assign(N * N, Complex(0.0, 0.0));
+				y2.assign(N * N, Complex(0.0, 0.0));
+			}
+
+			// G(R_b, .) in the real part and the indicator disk of R_b in the imaginary part.
+			// Both are real and even, so their spectra are the real and imaginary parts of one FFT.
+			// Mean of log |x| over a pixel centered at 0, (pi / 2 - 3 - log 2) / 2
+			const double meanLogInPixel = -1.0611754215844;
+			kernel.assign(N * N, Complex(0.0, 0.0));
+			GreenKernel green(Rb);
+			for (int dy = -support; dy <= support; ++dy) {
+				for (int dx = -support; dx <= support; ++dx) {
+					double l2 = dx * dx + dy * dy;
+					if (l2 >= Rb * Rb) { continue; }
+					// The center tap averages the log singularity over its pixel
+					double g = l2 > 0.0 ? green(l2) : (std::log(Rb) - meanLogInPixel) / TwoPI;
+					kernel[((dy + N) % N) * N + (dx + N) % N] = Complex(g, 1.0);
+				}
+			}
+			fft->Transform2D(kernel, false);
+
+			// Red and green, then blue and weight, packed as complex pairs
+			for (int pass = 0; pass < 2; ++pass) {
+				x1.assign(N * N, Complex(0.0, 0.0));
+				x2.assign(N * N, Complex(0.0, 0.0));
+				for (size_t i = begin; i < end; ++i) {
+					const SplatEvent& e = events[i];
+					double d = (e.R * e.R - Rb * Rb) / (2.0 * TwoPI * Rb * Rb);
+					Complex a, b;
+					if (pass == 0) {
+						a = Complex(e.color[0], e.color[1]);
+						b = d * a;
+					} else {
+						a = Complex(e.color[2], e.countWeight ? 0.0 : e.weight);
+						b = Complex(d * e.color[2], e.countWeight ? e.weight : d * e.weight);
+					}
+					Deposit(x1, N, e.cx + offset_x, e.cy + offset_y, a);
+					Deposit(x2, N, e.cx + offset_x, e.cy + offset_y, b);
+				}
+				fft->Transform2D(x1, false);
+				fft->Transform2D(x2, false);
+
+				std::vector<Complex>& y = pass == 0 ? y1 : y2;
+				for (int i = 0; i < N * N; ++i) {
+					y[i] += x1[i] * kernel[i].real() + x2[i] * kernel[i].imag();
+				}
+			}
+			begin = end;
+		}
+		flush();
+		events.clear();
+	}
+
+private:
+	int Bin(double R) const { return (int)std::floor(BinsPerOctave * std::log2(R / MinRadius)); }
+
+	double BinRadius(int bin) const { return MinRadius * std::pow(2.0, (bin + 0.5) / BinsPerOctave); }
+
+	// Bilinear impulse, the grid is padded so in-range events never touch the border
+	static void Deposit(std::vector<Complex>& grid, int N, double gx, double gy, Complex a)
+	{
+		int x0 = (int)std::floor(gx);
+		int y0 = (int)std::floor(gy);
+		if (x0 < 0 || y0 < 0 || x0 + 1 >= N || y0 + 1 >= N) { return; }
+		double fx = gx - x0, fy = gy - y0;
+		grid[y0 * N + x0] += (1.0 - fx) * (1.0 - fy) * a;
+		grid[y0 * N + x0 + 1] += fx * (1.0 - fy) * a;
+		grid[(y0 + 1) * N + x0] += (1.0 - fx) * fy * a;
+		grid[(y0 + 1) * N + x0 + 1] += fx * fy * a;
+	}
+
+	std::vector<SplatEvent> events;
+	std::shared_ptr<std::mutex> lock;
+};
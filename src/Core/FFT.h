@@ -0,0 +1,96 @@
+#pragma once
+#include "Common.h"
+#include <complex>
+
+using Complex = std::complex<double>;
+
+// Iterative radix-2 FFT on power of two sizes. Not the fastest, but small and
+// without dependencies. inverse = true also applies the 1 / n scale.
+class FFT
+{
+public:
+	FFT(int n) : n(n), twiddle(n / 2), reversed(n)
+	{
+		assert(n > 0 && (n & (n - 1)) == 0);
+		// The twiddles need pi to full precision, the 7 digits of PI are not enough
+		const double two_pi = 2.0 * std::acos(-1.0);
+		for (int k = 0; k < n / 2; ++k) {
+			double a = -two_pi * k / n;
+			twiddle[k] = Complex(std::cos(a), std::sin(a));
+		}
+
+		int bits = 0;
+		while ((1 << bits) < n) { ++bits; }
+		for (int i = 0; i < n; ++i) {
+			int r = 0;
+			for (int b = 0; b < bits; ++b) {
+				r |= ((i >> b) & 1) << (bits - 1 - b);
+			}
+			reversed[i] = r;
+		}
+	}
+
+	static int NextPowerOfTwo(int v)
+	{
+		int n = 1;
+		while (n < v) { n <<= 1; }
+		return n;
+	}
+
+	void Transform(Complex* data, bool inverse) const
+	{
+		for (int i = 0; i < n; ++i) {
+			if (i < reversed[i]) { std::swap(data[i], data[reversed[i]]); }
+		}
+
+		for (int len = 2; len <= n; len <<= 1) {
+			int step = n / len;
+			for (int i = 0; i < n; i += len) {
+				for (int k = 0; k < len / 2; ++k) {
+					Complex w = inverse ? std::conj(twiddle[k * step]) : twiddle[k * step];
+					Complex u = data[i + k];
+					Complex v = data[i + k + len / 2] * w;
+					data[i + k] = u + v;
+					data[i + k + len / 2] = u - v;
+				}
+			}
+		}
+
+		if (inverse) {
+			double scale = 1.0 / n;
+			for (int i = 0; i < n; ++i) { data[i] *= scale; }
+		}
+	}
+
+	// In place 2D transform of an n x n row major grid. Columns are transformed as
+	// rows of the transposed grid, which keeps every pass a linear walk.
+	void Transform2D(std::vector<Complex>& grid, bool inverse) const
+	{
+		for (int pass = 0; pass < 2; ++pass) {
+			for (int y = 0; y < n; ++y) {
+				Transform(&grid[y * n], inverse);
+			}
+			Transpose(grid);
+		}
+	}
+
+	void Transpose(std::vector<Complex>& grid) const
+	{
+		const int block = 16;
+		for (int by = 0; by < n; by += block) {
+			for (int bx = by; bx < n; bx += block) {
+				for (int y = by; y < min(by + block, n); ++y) {
+					for (int x = max(bx, y + 1); x < min(bx + block, n); ++x) {
+						std::swap(grid[y * n + x], grid[x * n + y]);
+					}
+				}
+			}
+		}
+	}
+
+	int n;
+
+private:
+	std::vector<Complex> twiddle;
+	std::vector<int> reversed;
+};
@@ -1,20 +1,217 @@
 #pragma once
 #include "Common.h"
+#include "DeferredSplat.h"
 #include <vector>
 #include<iostream>
 #include<fstream>
+#include <atomic>
+#include <memory>
+
+// Spin lock guarding one tile of an ImageBuffer shared by several threads.
+// Critical sections are a single span of at most TileSize pixels.
+struct TileLock {
+	std::atomic_flag flag = ATOMIC_FLAG_INIT;
+
+	void lock() { while (flag.test_and_set(std::memory_order_acquire)) {} }
+	void unlock() { flag.clear(std::memory_order_release); }
+};
+
+// Locks the tile for the lifetime of the guard, does nothing for a null lock
+struct TileGuard {
+	TileGuard(TileLock* l) : l(l) { if (l) { l->lock(); } }
+	~TileGuard() { if (l) { l->unlock(); } }
+
+	TileLock* l;
+};
+
+// Plain binary values of checkpoints, in the byte order of the machine
+template <typename T>
+inline void WriteBinary(std::ostream& out, const T& value) { out.write((const char*)&value, sizeof(T)); }
+
+template <typename T>
+inline bool ReadBinary(std::istream& in, T& value) { return (bool)in.read((char*)&value, sizeof(T)); }
+
+// Order of the pixels in memory
+enum class PixelLayout {
+	RowMajor, // Row by row (y major), as in PFM files
+	Tiled,    // TileSize x TileSize tiles, each one contiguous, so a disk touches few pages
+	Sparse    // Tiled, but a tile is only allocated when it is first written
+};
+
+// Tile blocks of a sparse ImageBuffer, allocated on their first write. Threads touching
+// the same new tile race with a compare and swap on its pointer and the loser frees its
+// block, so allocating never takes a lock. Copies duplicate the allocated tiles.
+template <typename T>
+class SparseTiles {
+public:
+	SparseTiles() {}
+
+	SparseTiles(int count, int tile_values)
+		: count(count), tile_values(tile_values), tiles(new std::atomic<T*>[count])
+	{
+		for (int tile = 0; tile < count; ++tile) {
+			tiles[tile].store(nullptr, std::memory_order_relaxed);
+		}
+	}
+
+	SparseTiles(const SparseTiles& other) : SparseTiles(other.count, other.tile_values)
+	{
+		for (int tile = 0; tile < count; ++tile) {
+			if (const T* t = other.Get(tile)) {
+				T* block = new T[tile_values];
+				std::copy(t, t + tile_values, block);
+				tiles[tile].store(block, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	SparseTiles(SparseTiles&& other) noexcept { Swap(other); }
+
+	SparseTiles& operator=(SparseTiles other) { Swap(other); return *this; }
+
+	~SparseTiles()
+	{
+		for (int tile = 0; tile < count; ++tile) {
+			delete[] tiles[tile].load(std::memory_order_relaxed);
+		}
+	}
+
+	int Count() const { return count; }
+
+	// Null for a tile nobody wrote yet
+	inline T* Get(int tile) const { return tiles[tile].load(std::memory_order_acquire); }
+
+	inline T* Touch(int tile) {
+		T* t = Get(tile);
+		if (t) { return t; }
+
+		T* block = new T[tile_values]();
+		if (tiles[tile].compare_exchange_strong(t, block, std::memory_order_acq_rel, std::memory_order_acquire)) {
+			return block;
+		}
+		// Another thread was first, t now holds its tile
+		delete[] block;
+		return t;
+	}
+
+	int AllocatedCount() const
+	{
+		int allocated = 0;
+		for (int tile = 0; tile < count; ++tile) {
+			if (Get(tile)) { ++allocated; }
+		}
+		return allocated;
+	}
+
+private:
+	void Swap(SparseTiles& other)
+	{
+		std::swap(count, other.count);
+		std::swap(tile_values, other.tile_values);
+		std::swap(tiles, other.tiles);
+	}
+
+	int count = 0;
+	int tile_values = 0;
+	std::unique_ptr<std::atomic<T*>[]> tiles;
+};
+
+// The part of the scene an image shows: the world space rectangle [lower, upper] sampled
+// by width x height square pixels, and optionally a mask of the pixels to compute
+// (width x height, row major, nonzero = computed). Solvers only pay for those pixels,
+// so a zoomed region of interest can be rendered at high resolution on its own.
+struct Window {
+	Vec2 lower, upper;
+	int width, height;
+	double pixel_size;
+
+	std::shared_ptr<const std::vector<unsigned char>> mask;
+	// Inclusive bounding box of the masked pixels, the whole image without a mask
+	int x_min, y_min, x_max, y_max;
+
+	// The whole [-ScreenSize, ScreenSize]^2 scene at res x res pixels
+	explicit Window(int res = DefaultResolution)
+		: Window(Vec2(-ScreenSize, -ScreenSize), Vec2(ScreenSize, ScreenSize), res, res) {}
+
+	// When the aspect ratios of the rectangle and of width x height differ the pixels are
+	// sized so the whole rectangle fits, and it is centered in the image
+	Window(Vec2 lower, Vec2 upper, int width, int height)
+		: lower(lower), upper(upper), width(width), height(height)
+	{
+		double sx = (upper[0] - lower[0]) / width;
+		double sy = (upper[1] - lower[1]) / height;
+		pixel_size = max(sx, sy);
+		if (sx != sy) {
+			Vec2 center = 0.5 * (lower + upper);
+			Vec2 half = 0.5 * pixel_size * Vec2((double)width, (double)height);
+			this->lower = center - half;
+			this->upper = center + half;
+		}
+		SetMask(nullptr);
+	}
+
+	// Compute only the pixels where mask is nonzero, null computes all of them
+	void SetMask(std::shared_ptr<const std::vector<unsigned char>> pixel_mask)
+	{
+		mask = pixel_mask;
+		x_min = 0; y_min = 0; x_max = width - 1; y_max = height - 1;
+		if (!mask) { return; }
+
+		assert((int)mask->size() == width * height);
+		x_min = width; y_min = height; x_max = -1; y_max = -1;
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				if (!(*mask)[y * width + x]) { continue; }
+				x_min = min(x_min, x); x_max = max(x_max, x);
+				y_min = min(y_min, y); y_max = max(y_max, y);
+			}
+		}
+	}
+
+	inline bool Wanted(int x, int y) const { return !mask || (*mask)[y * width + x] != 0; }
+
+	inline bool Contains(Vec2 p) const {
+		return lower[0] < p[0] && p[0] < upper[0] && lower[1] < p[1] && p[1] < upper[1];
+	}
+};
 
 class ImageBuffer {
 public:
-	ImageBuffer(int res) : res(res)
-	{ 
-		buffer = std::vector<std::vector<Vec3>>(res, std::vector<Vec3>(res, {0, 0, 0}));
-		PoissonKernelNormalizer = std::vector<std::vector<double>>(res, std::vector<double>(res, 0));
-		
-		scene_size = ScreenSize;
-		pixel_size = 2.0 * scene_size/ res;
+	// Every pixel stores its color and Poisson kernel weight next to each other (RGBW),
+	// pixels are laid out in a single aligned block following the PixelLayout, or in
+	// separate tile blocks for sparse buffers.
+	// Loops over the pixel index also visit the padding of tiled buffers, it stays zero,
+	// and only combine buffers that share the same layout. ForEachStoredPixel skips
+	// the tiles a sparse buffer never wrote.
+	static constexpr int Channels = 4;
+
+	// Granularity of the locks used when the buffer is written concurrently,
+	// and tile size of the tiled layouts
+	static constexpr int TileSize = 16;
+	static constexpr int TilePixels = TileSize * TileSize;
+
+	// Type the direct splats accumulate in. With FLOAT_ACCUMULATION they go to float partial
+	// sums next to the double pixels, and every 16 pixel row of a tile is added into the pixels
+	// and cleared once it took PartialAdds spans. So a float sum never holds more than
+	// PartialAdds terms: its relative error is below PartialAdds * 2^-24 (4e-6) and typically
+	// sqrt(PartialAdds) * 2^-25 (2e-7), whatever the number of walks, while the image itself
+	// still sums in double. Readers only see the splats after FlushPartials (ResolveSplats).
+#ifdef FLOAT_ACCUMULATION
+	using SplatReal = float;
+	static constexpr bool FloatAccumulation = true;
+#else
+	using SplatReal = double;
+	static constexpr bool FloatAccumulation = false;
+#endif
+	static constexpr int PartialAdds = 64;
 
+	ImageBuffer(const Window& window, PixelLayout layout = PixelLayout::RowMajor)
+	{
+		Init(window, layout);
 	}
+
+	// The whole scene at res x res pixels
+	ImageBuffer(int res, PixelLayout layout = PixelLayout::RowMajor) : ImageBuffer(Window(res), layout) {}
 	
 	// Read PFM
 	ImageBuffer(const string& name) {
@@ -25,136 +222,591 @@ public:
 		std::getline(file, format); // Dont' care this yet
 
 		// Get resolution and ignore line
-		file >> res;
+		int file_width, file_height;
+		file >> file_width >> file_height;
 
 		char lineEnd = 0x0a;
 		file.ignore(numeric_limits<streamsize>::max(), lineEnd);
 		file.ignore(numeric_limits<streamsize>::max(), lineEnd); // Skip two lines
 
 
-		// Will only use buffer
-		buffer = std::vector<std::vector<Vec3>>(res, std::vector<Vec3>(res, { 0, 0, 0 }));
-		scene_size = ScreenSize;
-		pixel_size = 2.0 * scene_size / res;
+		// Weights are not stored in the file and start from zero.
+		// The file does not know its window, it is taken to show the whole scene.
+		Init(Window(Vec2(-ScreenSize, -ScreenSize), Vec2(ScreenSize, ScreenSize), file_width, file_height),
+			PixelLayout::RowMajor);
 
-		float* float_buffer = new float[3 * res * res];
-		file.read((char*)float_buffer, sizeof(float) * 3 * res * res);
+		float* float_buffer = new float[3 * width * height];
+		file.read((char*)float_buffer, sizeof(float) * 3 * width * height);
 
-		for (int i = 0; i < res; ++i) {
-			for (int j = 0; j < res; ++j) {
-				Vec3& v = buffer[j][i];
-				v[0] = float_buffer[i * 3 * res + 3 * j + 0];
-				v[1] = float_buffer[i * 3 * res + 3 * j + 1];
-				v[2] = float_buffer[i * 3 * res + 3 * j + 2];
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				double* v = PixelData(PixelIndex(x, y));
+				const float* f = float_buffer + 3 * (y * width + x);
+				v[0] = f[0];
+				v[1] = f[1];
+				v[2] = f[2];
 			}
 		}
 		delete[] float_buffer;
 
 
 		// End read file
+	}
+
+	void Init(const Window& w, PixelLayout l)
+	{
+		window = w;
+		layout = l;
+		width = w.width;
+		height = w.height;
+		pixel_size = w.pixel_size;
+
+		tiles_x = (width + TileSize - 1) / TileSize;
+		tiles_y = (height + TileSize - 1) / TileSize;
+		if (layout == PixelLayout::Sparse) {
+			sparse_tiles = SparseTiles<double>(tiles_x * tiles_y, Channels * TilePixels);
+		} else {
+			pixels = PixelStorage(Channels * PixelCount(), 0.0);
+		}
+
+#ifdef FLOAT_ACCUMULATION
+		if (layout == PixelLayout::Sparse) {
+			sparse_partials = SparseTiles<float>(tiles_x * tiles_y, Channels * TilePixels);
+		} else {
+			partials = PartialStorage(Channels * PixelCount(), 0.0f);
+		}
+		partial_adds.assign(tiles_x * height, 0);
+#endif
+	}
+
+	inline int PixelCount() const {
+		return layout == PixelLayout::RowMajor ? width * height : tiles_x * tiles_y * TilePixels;
+	}
+
+	inline int PixelIndex(int x, int y) const {
+		if (layout == PixelLayout::RowMajor) { return y * width + x; }
+		// Coordinates are never negative, unsigned division by TileSize is a shift
+		unsigned int ux = x, uy = y;
+		unsigned int tile = (uy / TileSize) * tiles_x + ux / TileSize;
+		return (int)((tile * TileSize + uy % TileSize) * TileSize + ux % TileSize);
+	}
+
+	// Inverse of PixelIndex, padding pixels map outside [0, width) x [0, height)
+	inline Vec2i PixelCoord(int index) const {
+		if (layout == PixelLayout::RowMajor) { return Vec2i(index % width, index / width); }
+		int tile = index / (TileSize * TileSize);
+		int in_tile = index % (TileSize * TileSize);
+		return Vec2i((tile % tiles_x) * TileSize + in_tile % TileSize,
+			(tile / tiles_x) * TileSize + in_tile / TileSize);
+	}
+
+	// Writing through the non const version allocates the tile of a sparse buffer,
+	// reading an untouched tile gives zeros
+	inline double* PixelData(int index) {
+		if (layout == PixelLayout::Sparse) {
+			return sparse_tiles.Touch(index / TilePixels) + Channels * (index % TilePixels);
+		}
+		return &pixels[Channels * index];
+	}
+
+	inline const double* PixelData(int index) const {
+		if (layout == PixelLayout::Sparse) {
+			static const double zeros[Channels * TilePixels] = {};
+			const double* tile = sparse_tiles.Get(index / TilePixels);
+			return (tile ? tile : zeros) + Channels * (index % TilePixels);
+		}
+		return &pixels[Channels * index];
+	}
+
+	// Where the direct splats of pixel index accumulate, consecutive within a tile row
+	inline SplatReal* SplatData(int index) {
+#ifdef FLOAT_ACCUMULATION
+		if (layout == PixelLayout::Sparse) {
+			// The pixels of the tile have to exist for the flush
+			sparse_tiles.Touch(index / TilePixels);
+			return sparse_partials.Touch(index / TilePixels) + Channels * (index % TilePixels);
+		}
+		return &partials[Channels * index];
+#else
+		return PixelData(index);
+#endif
+	}
+
+	// One more span was added to the partial sums of the tile row holding pixel (x, y).
+	// Flushes them once they took PartialAdds spans. Runs under the tile lock.
+	inline void CountPartialAdds(int x, int y) {
+#ifdef FLOAT_ACCUMULATION
+		uint16_t& adds = partial_adds[y * tiles_x + x / TileSize];
+		if (++adds >= PartialAdds) {
+			FlushTileRow(x / TileSize, y);
+			adds = 0;
+		}
+#endif
+	}
 
-		PoissonKernelNormalizer = std::vector<std::vector<double>>(res, std::vector<double>(res, 0));
+	// Add the partial sums of the tile row tx of row y into the pixels and clear them
+	void FlushTileRow(int tx, int y) {
+		if (!FloatAccumulation) { return; }
+		int x0 = tx * TileSize;
+		int index = PixelIndex(x0, y);
+		double* v = PixelData(index);
+		SplatReal* p = SplatData(index);
+		for (int i = 0; i < Channels * min(TileSize, width - x0); ++i) {
+			v[i] += p[i];
+			p[i] = 0;
+		}
+	}
+
+	// Flush every partial sum, must not run while other threads still write
+	void FlushPartials() {
+#ifdef FLOAT_ACCUMULATION
+		for (int y = 0; y < height; ++y) {
+			for (int tx = 0; tx < tiles_x; ++tx) {
+				uint16_t& adds = partial_adds[y * tiles_x + tx];
+				if (adds == 0) { continue; }
+				FlushTileRow(tx, y);
+				adds = 0;
+			}
+		}
+#endif
+	}
+
+	// Pixel (x, y) if it is stored, null for an untouched tile of a sparse buffer
+	// and for pixels outside the window mask
+	inline double* StoredPixel(int x, int y) {
+		if (layout == PixelLayout::Sparse && !sparse_tiles.Get((y / TileSize) * tiles_x + x / TileSize)) {
+			return nullptr;
+		}
+		if (!window.Wanted(x, y)) { return nullptr; }
+		return PixelData(PixelIndex(x, y));
+	}
+
+	// Call f(index) for every stored pixel, all of them except untouched sparse tiles
+	template <typename F>
+	void ForEachStoredPixel(F f) const {
+		if (layout != PixelLayout::Sparse) {
+			for (int index = 0; index < PixelCount(); ++index) { f(index); }
+			return;
+		}
+		for (int tile = 0; tile < sparse_tiles.Count(); ++tile) {
+			if (!sparse_tiles.Get(tile)) { continue; }
+			for (int index = tile * TilePixels; index < (tile + 1) * TilePixels; ++index) { f(index); }
+		}
+	}
+
+	// Accumulated pixels for checkpoints: size, layout and every channel of the stored pixels,
+	// untouched sparse tiles are left out. Postponed splats have to be resolved before.
+	void WriteState(std::ostream& out) const {
+		WriteBinary(out, width);
+		WriteBinary(out, height);
+		WriteBinary(out, (int)layout);
+		if (layout != PixelLayout::Sparse) {
+			out.write((const char*)pixels.data(), sizeof(double) * pixels.size());
+			return;
+		}
+		WriteBinary(out, sparse_tiles.AllocatedCount());
+		for (int tile = 0; tile < sparse_tiles.Count(); ++tile) {
+			const double* t = sparse_tiles.Get(tile);
+			if (!t) { continue; }
+			WriteBinary(out, tile);
+			out.write((const char*)t, sizeof(double) * Channels * TilePixels);
+		}
+	}
+
+	// Replace the pixels by the ones WriteState wrote, false if the size or layout differ
+	bool ReadState(std::istream& in) {
+		int w = 0, h = 0, l = -1;
+		if (!ReadBinary(in, w) || !ReadBinary(in, h) || !ReadBinary(in, l)) { return false; }
+		if (w != width || h != height || l != (int)layout) { return false; }
+		if (layout != PixelLayout::Sparse) {
+			return (bool)in.read((char*)pixels.data(), sizeof(double) * pixels.size());
+		}
+		int count = 0;
+		if (!ReadBinary(in, count)) { return false; }
+		for (int i = 0; i < count; ++i) {
+			int tile = -1;
+			if (!ReadBinary(in, tile) || tile < 0 || tile >= sparse_tiles.Count()) { return false; }
+			if (!in.read((char*)sparse_tiles.Touch(tile), sizeof(double) * Channels * TilePixels)) { return false; }
+		}
+		return true;
+	}
+
+	// Allocate the sparse tiles under the bounding box of a disk, in pixel units, as far as
+	// it overlaps the region of interest of the window. Splats
+	// that are only added to the image by ResolveSplats reserve their tiles this way.
+	void TouchDiskTiles(double cx, double cy, double R) {
+		if (layout != PixelLayout::Sparse) { return; }
+		int x0 = max(window.x_min, (int)std::floor(cx - R)), x1 = min(window.x_max, (int)std::ceil(cx + R));
+		int y0 = max(window.y_min, (int)std::floor(cy - R)), y1 = min(window.y_max, (int)std::ceil(cy + R));
+		if (x0 > x1 || y0 > y1) { return; }
+		for (int ty = y0 / TileSize; ty <= y1 / TileSize; ++ty) {
+			for (int tx = x0 / TileSize; tx <= x1 / TileSize; ++tx) {
+				sparse_tiles.Touch(ty * tiles_x + tx);
+			}
+		}
+	}
+
+	// Memory held by the pixels and partial sums, tiles not allocated by a sparse buffer cost nothing
+	size_t PixelBytes() const {
+		size_t stored = layout == PixelLayout::Sparse ? (size_t)sparse_tiles.AllocatedCount() * TilePixels : PixelCount();
+		size_t bytes = stored * Channels * sizeof(double);
+#ifdef FLOAT_ACCUMULATION
+		size_t partial = layout == PixelLayout::Sparse ? (size_t)sparse_partials.AllocatedCount() * TilePixels : PixelCount();
+		bytes += partial * Channels * sizeof(float) + partial_adds.size() * sizeof(uint16_t);
+#endif
+		return bytes;
+	}
+
+	inline Vec3 GetColor(int index) const {
+		const double* v = PixelData(index);
+		return Vec3(v[0], v[1], v[2]);
+	}
+
+	inline void SetColor(int index, const Vec3& c) {
+		double* v = PixelData(index);
+		v[0] = c[0];
+		v[1] = c[1];
+		v[2] = c[2];
+	}
+
+	inline double GetWeight(int index) const { return PixelData(index)[3]; }
+
+	// After this call every write takes the lock of the tile it touches,
+	// so all threads of a solve can accumulate into this one buffer
+	void EnableConcurrentWrites() {
+		tile_locks = std::make_shared<std::vector<TileLock>>(tiles_x * tiles_y);
+		AllocateMipLocks();
+		deferred.EnableConcurrentWrites();
+	}
+
+	// Pyramid levels are small, they are locked row by row
+	void AllocateMipLocks() {
+		for (auto& mip : mip_levels) {
+			mip.row_locks = std::make_shared<std::vector<TileLock>>(mip.height);
+		}
+	}
+
+	bool IsConcurrent() const { return tile_locks != nullptr; }
+
+	inline TileLock* GetTileLock(int x, int y) const {
+		if (!tile_locks) { return nullptr; }
+		return &(*tile_locks)[(y / TileSize) * tiles_x + x / TileSize];
+	}
+
+	// Add w * c to the color and w to the Poisson kernel weight
+	inline void Accumulate(int index, const Vec3& c, double w) {
+		Accumulate(PixelData(index), c, w, w);
+	}
+
+	// Add cw * c to the color and w to the Poisson kernel weight of one RGBW pixel,
+	// T being double or SplatReal
+	template <typename T>
+	static inline void Accumulate(T* v, const Vec3& c, double cw, double w) {
+		v[0] += T(cw * c[0]);
+		v[1] += T(cw * c[1]);
+		v[2] += T(cw * c[2]);
+		v[3] += T(w);
 	}
 
 	Vec3 GetPixel(Vec2 p) const {
-		if (-scene_size < p[0] && p[0] < scene_size &&
-			-scene_size < p[1] && p[1] < scene_size) {
+		if (window.Contains(p)) {
 			Vec2i coor = world2img(p);
-			return buffer[coor[0]][coor[1]];
+			return GetColor(PixelIndex(coor[0], coor[1]));
 		}
 		return Vec3(0.0, 0.0, 0.0);
 	}
 
 	double GetPoissonKerynelEstimate(Vec2 p) const
 	{
-		if (-scene_size < p[0] && p[0] < scene_size &&
-			-scene_size < p[1] && p[1] < scene_size) {
+		if (window.Contains(p)) {
 			Vec2i coor = world2img(p);
-			return PoissonKernelNormalizer[coor[0]][coor[1]];
+			return GetWeight(PixelIndex(coor[0], coor[1]));
 		}
 		return 0.0;
 	}
 	
 	inline Vec2i world2img(Vec2 p) const {
-		int x = (p[0] + scene_size) * res / (2.0 * scene_size);
-		int y = (p[1] + scene_size) * res / (2.0 * scene_size);
+		int x = (p[0] - window.lower[0]) * width / (window.upper[0] - window.lower[0]);
+		int y = (p[1] - window.lower[1]) * height / (window.upper[1] - window.lower[1]);
 		Vec2i coor = Vec2i(x, y);
 		return coor;
 	}
 
 	inline Vec2 img2world(Vec2i coor) const {
-		double x = 2.0 * scene_size * (coor[0] + 0.5) / (double)res - scene_size;
-		double y = 2.0 * scene_size * (coor[1] + 0.5) / (double)res - scene_size;
+		double x = (window.upper[0] - window.lower[0]) * (coor[0] + 0.5) / (double)width + window.lower[0];
+		double y = (window.upper[1] - window.lower[1]) * (coor[1] + 0.5) / (double)height + window.lower[1];
 		return Vec2(x, y);
 	}
 
 	// w is here to help normalize Poisson kernel
 	void WritePixel(Vec2 p, Vec3 v, double w=1.0) {
-		if (-scene_size < p[0] && p[0] < scene_size &&
-			-scene_size < p[1] && p[1] < scene_size) {
+		if (window.Contains(p)) {
 			Vec2i coor = world2img(p);
-			buffer[coor[0]][coor[1]] += w * v;
-			PoissonKernelNormalizer[coor[0]][coor[1]] += w;
+			TileGuard guard(GetTileLock(coor[0], coor[1]));
+			Accumulate(PixelIndex(coor[0], coor[1]), v, w);
 		}
 	}
 
-	void DrawGreenSphere(Vec2 pos, double r, Vec3 source, std::mt19937& gen) {
-		Vec2i coor = world2img(pos);
-		
+	void DrawGreenSphere(Vec2 pos, double r, Vec3 source, Sampler& sampler) {
 #ifdef UniformInPixel
-		double dx = (Rand01(gen) - 0.5) * pixel_size;
-		double dy = (Rand01(gen) - 0.5) * pixel_size;
+		Vec2 u = sampler.Next2D();
+		double dx = (u[0] - 0.5) * pixel_size;
+		double dy = (u[1] - 0.5) * pixel_size;
 		Vec2 offset{ dx, dy };
 #else 
 		Vec2 offset{ 0.0, 0.0 };
 #endif
-		int pixel_r = int(r / pixel_size + 1);
-		for (int x = coor[0] - pixel_r; x <= coor[0] + pixel_r; ++x) {
-			for (int y = coor[1] - pixel_r; y <= coor[1] + pixel_r; ++y) {
-				Vec2 p = img2world({x, y}) + offset;
-
-				double l = (p - pos).norm();
-				if(l > r) { 
-					continue; 
-				}
-				double g = Green(r, l);
-				WritePixel(p, g * source);
-			}
-		}
+		if (DeferSplat(pos, r, offset, source, 1.0, true)) { return; }
+		DrawDisk(pos, r, offset, 1.0, [&](auto* v, double g) {
+			Accumulate(v, source, g, 1.0);
+		});
 	}
 
 	// Need to pass in weight s.t. every pixel's Poisson Kernel is normalized
-	void DrawGreenSphere(Vec2 pos, double r, double weight, Vec3 source, std::mt19937& gen) {
-		Vec2i coor = world2img(pos);
+	void DrawGreenSphere(Vec2 pos, double r, double weight, Vec3 source, Sampler& sampler) {
 #ifdef UniformInPixel
-		double dx = (Rand01(gen) - 0.5) * pixel_size;
-		double dy = (Rand01(gen) - 0.5) * pixel_size;
+		Vec2 u = sampler.Next2D();
+		double dx = (u[0] - 0.5) * pixel_size;
+		double dy = (u[1] - 0.5) * pixel_size;
 		Vec2 offset{ dx, dy };
 #else
 		Vec2 offset{ 0.0, 0.0 };
 #endif
+		if (DeferSplat(pos, r, offset, weight * source, weight, false)) { return; }
+		DrawDisk(pos, r, offset, weight, [&](auto* v, double g) {
+			Accumulate(v, source, g, g);
+		});
+	}
 
-		int pixel_r = int(r / pixel_size + 1);
-		for (int x = coor[0] - pixel_r; x <= coor[0] + pixel_r; ++x) {
-			for (int y = coor[1] - pixel_r; y <= coor[1] + pixel_r; ++y) {
-				Vec2 p = img2world({ x, y }) + offset;
+	// Hand the disk to the deferred splatter if its radius is in the deferred range,
+	// returns false if the caller has to draw it
+	bool DeferSplat(Vec2 pos, double r, Vec2 offset, Vec3 color, double weight, bool countWeight) {
+		double R = r / pixel_size;
+		if (!deferred.Accepts(R)) { return false; }
+		double cx = (pos[0] - window.lower[0] - offset[0]) / pixel_size - 0.5;
+		double cy = (pos[1] - window.lower[1] - offset[1]) / pixel_size - 0.5;
+		if (!DiskInWindow(cx, cy, R)) { return true; }
+		TouchDiskTiles(cx, cy, deferred.SupportRadius(R));
+		deferred.Record(SplatEvent{ cx, cy, R, color, weight, countWeight });
+		return true;
+	}
 
-				double l = (p - pos).norm();
-				if (l > r) {
-					continue;
+	// False if the disk around (cx, cy) of R pixels misses the bounding box of the window mask
+	inline bool DiskInWindow(double cx, double cy, double R) const {
+		return cx + R >= window.x_min && cy + R >= window.y_min && cx - R <= window.x_max && cy - R <= window.y_max;
+	}
+
+	// Call splat(pixel, g) with g = scale * G(r, l) for every covered pixel, either on the
+	// full resolution image (pixel is a SplatReal*) or, for wide disks, on the matching level
+	// of the pyramid (double*). Disks outside the region of interest of the window are skipped.
+	template <typename S>
+	void DrawDisk(Vec2 pos, double r, Vec2 offset, double scale, S splat) {
+		int level = MipLevelFor(r / pixel_size);
+		if (level == 0) {
+			GreenKernel kernel(r / pixel_size, scale);
+			ForEachDiskSegment(pos, r, offset, [&](int y, int x_begin, int x_end, int index, double& ex, double ey2) {
+				SplatReal* v = SplatData(index);
+				for (int x = x_begin; x <= x_end; ++x, v += Channels, ex += 1.0) {
+					splat(v, kernel(ex * ex + ey2));
 				}
-				double g = Green(r, l);
-				WritePixel(p, source, weight * g);
+				CountPartialAdds(x_begin, y);
+			});
+			return;
+		}
+
+		// Interpolating the level back spreads the splat less than two coarse pixels past the disk
+		double px = (pos[0] - window.lower[0] - offset[0]) / pixel_size - 0.5;
+		double py = (pos[1] - window.lower[1] - offset[1]) / pixel_size - 0.5;
+		if (!DiskInWindow(px, py, r / pixel_size)) { return; }
+		TouchDiskTiles(px, py, r / pixel_size + (2 << level));
+
+		// Same jitter, in coarse pixel units, so the coarse sample grid is uniformly shifted too
+		MipLevel& mip = mip_levels[level - 1];
+		double cell = pixel_size * (1 << level);
+		double cx = (pos[0] - window.lower[0]) / cell - offset[0] / pixel_size - 0.5;
+		double cy = (pos[1] - window.lower[1]) / cell - offset[1] / pixel_size - 0.5;
+		GreenKernel kernel(r / cell, scale);
+		RasterizeDisk(0, 0, mip.width - 1, mip.height - 1, cx, cy, r / cell, [&](int y, int x_begin, int x_end, double ex, double ey2) {
+			TileGuard guard(mip.row_locks ? &(*mip.row_locks)[y] : nullptr);
+			double* v = &mip.pixels[Channels * (y * mip.width + x_begin)];
+			for (int x = x_begin; x <= x_end; ++x, v += Channels, ex += 1.0) {
+				splat(v, kernel(ex * ex + ey2));
+			}
+		});
+	}
+
+	// Call f(index, l2) for every pixel whose sample point (pixel center + offset)
+	// lies in the disk of radius r around pos, l2 being the squared distance to pos
+	// in pixel units, so it pairs with GreenKernel(r / pixel_size).
+	// Only pixels in the bounding box of the window mask are visited.
+	template <typename F>
+	void ForEachDiskPixel(Vec2 pos, double r, Vec2 offset, F f) const {
+		ForEachDiskSegment(pos, r, offset, [&](int y, int x_begin, int x_end, int index, double& ex, double ey2) {
+			for (int x = x_begin; x <= x_end; ++x, ++index, ex += 1.0) {
+				f(index, ex * ex + ey2);
+			}
+		});
+	}
+
+	// Same disk as ForEachDiskPixel, as segments of a row whose pixel indices are consecutive:
+	// seg(y, x_begin, x_end, index, ex, ey2) with index the one of x_begin, ex = x_begin - cx
+	// and ey2 = (y - cy)^2. seg has to step ex by one per pixel, so that split spans carry
+	// the same ex as whole ones. Segments run under the lock of their tile.
+	template <typename F>
+	void ForEachDiskSegment(Vec2 pos, double r, Vec2 offset, F seg) const {
+		// Disk center and radius in pixel units, relative to the jittered sample grid
+		double cx = (pos[0] - window.lower[0] - offset[0]) / pixel_size - 0.5;
+		double cy = (pos[1] - window.lower[1] - offset[1]) / pixel_size - 0.5;
+
+		RasterizeDisk(window.x_min, window.y_min, window.x_max, window.y_max, cx, cy, r / pixel_size, [&](int y, int x_begin, int x_end, double ex, double ey2) {
+			// Spans are cut at tile borders, where the lock changes, tiled indices jump and
+			// partial sums are counted. Otherwise the whole span is a single segment.
+			bool split = tile_locks || layout != PixelLayout::RowMajor || FloatAccumulation;
+			for (int x0 = x_begin; x0 <= x_end; ) {
+				int x1 = split ? min(x_end, (x0 / TileSize + 1) * TileSize - 1) : x_end;
+				TileGuard guard(GetTileLock(x0, y));
+				seg(y, x0, x1, PixelIndex(x0, y), ex, ey2);
+				x0 = x1 + 1;
+			}
+		});
+	}
+
+	// Rasterize the disk of radius R around (cx, cy) on a grid whose sample points sit at
+	// integer coordinates, clipped to the cells [x_min, x_max] x [y_min, y_max], everything
+	// in grid cell units. span(y, x_begin, x_end, ex, ey2) is called once per covered row
+	// with ex = x_begin - cx and ey2 = (y - cy)^2. Spans are computed analytically and
+	// clipped, so there is no per pixel rejection or bounds check.
+	template <typename S>
+	static void RasterizeDisk(int x_min, int y_min, int x_max, int y_max, double cx, double cy, double R, S span) {
+		int y_begin = max((int)std::ceil(cy - R), y_min);
+		int y_end = min((int)std::floor(cy + R), y_max);
+		int x_begin = max((int)std::ceil(cx - R), x_min);
+		int x_end = min((int)std::floor(cx + R), x_max);
+
+		// Entirely off-screen
+		if (y_begin > y_end || x_begin > x_end) { return; }
+
+		// Smaller than a pixel, so at most one sample point can be covered
+		if (R < 0.5) {
+			int x = (int)std::floor(cx + 0.5);
+			int y = (int)std::floor(cy + 0.5);
+			double ex = x - cx, ey = y - cy;
+			if (x >= x_min && x <= x_max && y >= y_min && y <= y_max && ex * ex + ey * ey <= R * R) {
+				span(y, x, x, ex, ey * ey);
+			}
+			return;
+		}
+
+		for (int y = y_begin; y <= y_end; ++y) {
+			double ey = y - cy;
+			double h2 = R * R - ey * ey;
+			if (h2 < 0.0) { continue; }
+
+			double h = std::sqrt(h2);
+			int span_begin = max((int)std::ceil(cx - h), x_min);
+			int span_end = min((int)std::floor(cx + h), x_max);
+			if (span_begin <= span_end) {
+				span(y, span_begin, span_end, span_begin - cx, ey * ey);
 			}
 		}
 	}
 
+	// Hierarchical splatting for reverse WoS, where steps far from the boundary draw huge disks.
+	// A disk of R >= 2 * radius pixels is drawn on pyramid level l = floor(log2(R / radius)),
+	// where it spans between radius and 2 * radius coarse pixels, so a splat costs O(radius^2)
+	// whatever r is. ResolveMipLevels interpolates the levels back bilinearly.
+	// Error: level l holds the kernel at its jittered coarse sample points, so the resolved
+	// splat is the direct one filtered by a tent of half width h = 2^l <= R / radius pixels.
+	// At distance l from the center the difference is bounded by h^2 / (8pi (l - 1.5h)^2)
+	// (bilinear error with |Hessian of G| = 1 / (2pi l^2)), and by h / (2pi R) within h of the rim.
+	void EnableMipSplatting(int radius = 32) {
+		mip_radius = radius;
+		mip_levels.clear();
+		int side = max(width, height);
+		for (int level = 1; ((side + (1 << level) - 1) >> level) >= radius; ++level) {
+			MipLevel mip;
+			mip.width = (width + (1 << level) - 1) >> level;
+			mip.height = (height + (1 << level) - 1) >> level;
+			mip.pixels = PixelStorage(Channels * mip.width * mip.height, 0.0);
+			mip_levels.push_back(mip);
+		}
+		if (tile_locks) { AllocateMipLocks(); }
+	}
+
+	// Level a disk of R pixels is drawn on, 0 being the full resolution image
+	int MipLevelFor(double R) const {
+		int level = 0;
+		while (level < (int)mip_levels.size() && R >= 2.0 * mip_radius * (1 << level)) {
+			++level;
+		}
+		return level;
+	}
+
+	// Deferred splatting, see DeferredSplatter. Disks of minRadius up to half the image are
+	// recorded and only drawn by ResolveSplats, all at once with FFT convolutions.
+	// Wider disks still go through the pyramid or are drawn directly.
+	void EnableDeferredSplatting(int minRadius = 16, int binsPerOctave = 4) {
+		deferred.Enable(max(width, height), minRadius, binsPerOctave);
+	}
+
+	// Draw everything that was postponed, the partial sums, the pyramid levels and the deferred splats.
+	// Must not run while other threads still write.
+	void ResolveSplats() {
+		FlushPartials();
+		ResolveMipLevels();
+		deferred.Resolve(width, height, [this](int x, int y) { return StoredPixel(x, y); });
+	}
+
+	// Add every pyramid level into the full resolution image with bilinear interpolation
+	// and clear the pyramid. Must not run while other threads still write.
+	void ResolveMipLevels() {
+		std::vector<int> x_left(width), x_right(width);
+		std::vector<double> x_frac(width);
+
+		for (int level = 1; level <= (int)mip_levels.size(); ++level) {
+			MipLevel& mip = mip_levels[level - 1];
+			auto interpolate = [&](int i, int n, int& a, int& b, double& t) {
+				double u = max((i + 0.5) / (1 << level) - 0.5, 0.0);
+				a = min((int)u, n - 1);
+				b = min(a + 1, n - 1);
+				t = u - a;
+			};
+			for (int x = 0; x < width; ++x) {
+				interpolate(x, mip.width, x_left[x], x_right[x], x_frac[x]);
+			}
+
+			for (int y = 0; y < height; ++y) {
+				int y0, y1;
+				double ty;
+				interpolate(y, mip.height, y0, y1, ty);
+				const double* row0 = &mip.pixels[Channels * y0 * mip.width];
+				const double* row1 = &mip.pixels[Channels * y1 * mip.width];
+
+				for (int x = 0; x < width; ++x) {
+					double* v = StoredPixel(x, y);
+					if (!v) { continue; }
+					const double* a0 = row0 + Channels * x_left[x];
+					const double* b0 = row0 + Channels * x_right[x];
+					const double* a1 = row1 + Channels * x_left[x];
+					const double* b1 = row1 + Channels * x_right[x];
+					double tx = x_frac[x];
+					for (int c = 0; c < Channels; ++c) {
+						double top = a0[c] + tx * (b0[c] - a0[c]);
+						double bottom = a1[c] + tx * (b1[c] - a1[c]);
+						v[c] += top + ty * (bottom - top);
+					}
+				}
+			}
+			std::fill(mip.pixels.begin(), mip.pixels.end(), 0.0);
+		}
+	}
+
 	// Not saving PNG using stb anymore
 	//void SaveImage(const string& name) 
 	//{
-	//	FloatImage img(res, res, 3);
-	//	for (int i = 0; i < res; ++i) {
-	//		for (int j = 0; j < res; ++j) {
+	//	FloatImage img(width, height, 3);
+	//	for (int i = 0; i < width; ++i) {
+	//		for (int j = 0; j < height; ++j) {
 	//			const Vec3& v = buffer[i][j];
 	//			img(i, j, 0) = v[0];
 	//			img(i, j, 1) = v[1];
@@ -165,10 +817,10 @@ public:
 	//}
 
 	void SaveImagePFM(const string& name) {
-		_WritePFM(name, buffer);
+		_WritePFM(name);
 	}
 
-	void _WritePFM(const string& name, std::vector<std::vector<Vec3>>& imgbuffer)
+	void _WritePFM(const string& name)
 	{
 		ofstream file;
 		file.open(name.c_str(), ios::out | ios::trunc | ios::binary);
@@ -177,7 +829,7 @@ public:
 		char lineEnd = 0x0a;
 		file << type[0] << type[1] << lineEnd;
 
-		file << res << ' ' << res << lineEnd;
+		file << width << ' ' << height << lineEnd;
 		float endian = 0.0f;
 		{
 			// https://stackoverflow.com/questions/1001307/detecting-endianness-programmatically-in-a-c-program
@@ -191,25 +843,69 @@ public:
 		file << endian << lineEnd;
 		
 
-		float* float_buffer = new float[3 * res * res];
-		for (int i = 0; i < res; ++i) {
-			for (int j = 0; j < res; ++j) {
-				const Vec3& v = imgbuffer[j][i];
-				float_buffer[i * 3 * res + 3 * j + 0] = v[0];
-				float_buffer[i * 3 * res + 3 * j + 1] = v[1];
-				float_buffer[i * 3 * res + 3 * j + 2] = v[2];
+		float* float_buffer = new float[3 * width * height];
+		auto store = [&](int x, int y, const double* v) {
+			float* f = float_buffer + 3 * (y * width + x);
+			f[0] = v[0];
+			f[1] = v[1];
+			f[2] = v[2];
+		};
+		if (layout == PixelLayout::Sparse) {
+			// Only the allocated tiles are visited, the rest of the image is zero
+			std::fill(float_buffer, float_buffer + 3 * width * height, 0.0f);
+			ForEachStoredPixel([&](int index) {
+				Vec2i c = PixelCoord(index);
+				if (c[0] < width && c[1] < height) { store(c[0], c[1], PixelData(index)); }
+			});
+		} else {
+			for (int y = 0; y < height; ++y) {
+				for (int x = 0; x < width; ++x) {
+					store(x, y, PixelData(PixelIndex(x, y)));
+				}
 			}
 		}
-		file.write((char*)float_buffer, sizeof(float) * 3 * res * res);
+		file.write((char*)float_buffer, sizeof(float) * 3 * width * height);
 
 		delete[] float_buffer;
 		file.close();
 	}
 
-	std::vector<std::vector<Vec3>> buffer;
-	std::vector< std::vector<double>> PoissonKernelNormalizer;
+	using PixelStorage = std::vector<double, Eigen::aligned_allocator<double>>;
+	PixelStorage pixels;
+
+	PixelLayout layout = PixelLayout::RowMajor;
+	int tiles_x = 0;
+	int tiles_y = 0;
+
+	// Pixels of a sparse buffer, which leaves pixels empty
+	SparseTiles<double> sparse_tiles;
+
+#ifdef FLOAT_ACCUMULATION
+	// Float partial sums of the direct splats, laid out like the pixels,
+	// and the number of spans each tile row took since its last flush
+	using PartialStorage = std::vector<float, Eigen::aligned_allocator<float>>;
+	PartialStorage partials;
+	SparseTiles<float> sparse_partials;
+	std::vector<uint16_t> partial_adds;
+#endif
+
+	// Only allocated by EnableConcurrentWrites, copies share the same locks
+	std::shared_ptr<std::vector<TileLock>> tile_locks;
+
+	// Coarse levels 1, 2, ... of the splatting pyramid, level l has pixels 2^l times wider
+	struct MipLevel {
+		int width, height;
+		PixelStorage pixels;
+		std::shared_ptr<std::vector<TileLock>> row_locks;
+	};
+	std::vector<MipLevel> mip_levels;
+	int mip_radius = 0;
+
+	// Splats recorded for ResolveSplats, copies keep their own events
+	DeferredSplatter deferred;
 
-	int res;
+	Window window; // The img will show [window.lower, window.upper]
+	int width;
+	int height;
 	double pixel_size;
-	double scene_size; // The img will show [-scene_size, scene_size]
 };
\ No newline at end of file
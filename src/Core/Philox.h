@@ -0,0 +1,78 @@
+#pragma once
+#include <cstdint>
+
+// Philox4x32-10 (Salmon et al. 2011, as in Random123), a counter based generator: every
+// 4 random words are a bijective hash of a 128 bit counter under a 64 bit key, so any
+// position of any stream is drawn directly and nothing carries over from other streams.
+// A walk reads the stream (key, walk) in order, its d-th word is dimension d of the walk.
+// Which thread runs the walk, and in which chunk or order, cannot change what it draws.
+// Satisfies UniformRandomBitGenerator, so the standard distributions take it as well.
+class Philox
+{
+public:
+	using result_type = uint32_t;
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return 0xFFFFFFFFu; }
+
+	Philox(uint64_t key, uint64_t walk) { Seek(key, walk); }
+
+	// Restart at the first dimension of stream walk of key
+	void Seek(uint64_t key, uint64_t walk)
+	{
+		k0 = (uint32_t)key;
+		k1 = (uint32_t)(key >> 32);
+		c2 = (uint32_t)walk;
+		c3 = (uint32_t)(walk >> 32);
+		block = 0;
+		used = 4;
+	}
+
+	result_type operator()()
+	{
+		if (used == 4) { Generate(); }
+		return words[used++];
+	}
+
+	// Uniform in [0, 1) with 53 random bits, from two words
+	double Next01()
+	{
+		uint32_t a = (*this)() >> 5, b = (*this)() >> 6;
+		return (a * 67108864.0 + b) * (1.0 / 9007199254740992.0);
+	}
+
+private:
+	static inline void MulHiLo(uint32_t a, uint32_t b, uint32_t& hi, uint32_t& lo)
+	{
+		uint64_t p = (uint64_t)a * b;
+		hi = (uint32_t)(p >> 32);
+		lo = (uint32_t)p;
+	}
+
+	// The words of counter (block, 0, c2, c3)
+	void Generate()
+	{
+		uint32_t x0 = block++, x1 = 0, x2 = c2, x3 = c3;
+		uint32_t key0 = k0, key1 = k1;
+		for (int round = 0; round < 10; ++round) {
+			uint32_t hi0, lo0, hi1, lo1;
+			MulHiLo(0xD2511F53u, x0, hi0, lo0);
+			MulHiLo(0xCD9E8D57u, x2, hi1, lo1);
+			x0 = hi1 ^ x1 ^ key0;
+			x1 = lo1;
+			x2 = hi0 ^ x3 ^ key1;
+			x3 = lo0;
+			key0 += 0x9E3779B9u;
+			key1 += 0xBB67AE85u;
+		}
+		words[0] = x0;
+		words[1] = x1;
+		words[2] = x2;
+		words[3] = x3;
+		used = 0;
+	}
+
+	uint32_t k0, k1, c2, c3;
+	uint32_t block;
+	uint32_t words[4];
+	int used;
+};
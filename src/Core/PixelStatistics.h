@@ -0,0 +1,101 @@
+#pragma once
+#include "Common.h"
+#include "ImageBuffer.h"
+#include <memory>
+
+// Running per-pixel statistics of a series of images, every image being one sample:
+// the count, the mean and M2, the sum of squared deviations from the mean (Welford).
+// Statistics of disjoint series merge with Chan's formula
+//   n = n_a + n_b, d = mean_b - mean_a, mean = mean_a + d n_b / n, M2 = M2_a + M2_b + d^2 n_a n_b / n
+// so thread and batch results combine in any order, in one pass and without keeping the
+// samples. Only the colors get an M2, the Poisson kernel weight is averaged.
+class PixelStatistics
+{
+public:
+	// Statistics of the single sample image, which is taken over as the mean
+	explicit PixelStatistics(ImageBuffer&& image) : mean(std::move(image)) {}
+
+	// Add the samples of other, a series of images with the same window and layout
+	void Merge(const PixelStatistics& other)
+	{
+		if (!m2) { m2 = std::make_unique<ImageBuffer>(mean.window, mean.layout); }
+		// Pixels other stores have to be visited even where this series never wrote
+		if (mean.layout == PixelLayout::Sparse) {
+			other.mean.ForEachStoredPixel([&](int index) { mean.PixelData(index); });
+		}
+
+		const double na = count, nb = other.count, n = na + nb;
+		mean.ForEachStoredPixel([&](int index) {
+			double* a = mean.PixelData(index);
+			const double* b = other.mean.PixelData(index);
+			double* a2 = m2->PixelData(index);
+			const double* b2 = other.m2 ? other.m2->PixelData(index) : nullptr;
+			for (int c = 0; c < ImageBuffer::Channels; ++c) {
+				double d = b[c] - a[c];
+				a[c] += d * nb / n;
+				if (c < 3) { a2[c] += (b2 ? b2[c] : 0.0) + d * d * na * nb / n; }
+			}
+		});
+		count += other.count;
+	}
+
+	// Unbiased variance of the samples of one pixel, zero for a single sample
+	Vec3 Variance(int index) const
+	{
+		if (!m2 || count < 2) { return Vec3(0.0, 0.0, 0.0); }
+		return m2->GetColor(index) / (count - 1);
+	}
+
+	// Standard deviation of one sample over the mean
+	Vec3 ReleativeSD(int index) const
+	{
+		const Vec3 v = Variance(index);
+		const Vec3 a = mean.GetColor(index);
+		return Vec3{ sqrt(v[0]) / a[0], sqrt(v[1]) / a[1], sqrt(v[2]) / a[2] };
+	}
+
+	// Relative standard error of the mean, sqrt(Var / count) / |mean|, averaged over the color
+	// channels of every pixel with a nonzero mean. Infinite before there are two samples.
+	double MeanReleativeError() const
+	{
+		if (!m2 || count < 2) { return std::numeric_limits<double>::infinity(); }
+		double sum = 0.0;
+		long long terms = 0;
+		mean.ForEachStoredPixel([&](int index) {
+			const Vec3 v = Variance(index);
+			const Vec3 a = mean.GetColor(index);
+			for (int c = 0; c < 3; ++c) {
+				if (a[c] == 0.0) { continue; }
+				sum += sqrt(v[c] / count) / std::abs(a[c]);
+				++terms;
+			}
+		});
+		return terms > 0 ? sum / terms : 0.0;
+	}
+
+	void WriteState(std::ostream& out) const
+	{
+		WriteBinary(out, count);
+		mean.WriteState(out);
+		WriteBinary(out, (int)(m2 != nullptr));
+		if (m2) { m2->WriteState(out); }
+	}
+
+	// Replace the statistics by the ones WriteState wrote, false if they do not fit this image
+	bool ReadState(std::istream& in)
+	{
+		int has_m2 = 0;
+		if (!ReadBinary(in, count) || !mean.ReadState(in) || !ReadBinary(in, has_m2)) { return false; }
+		m2.reset();
+		if (!has_m2) { return true; }
+		m2 = std::make_unique<ImageBuffer>(mean.window, mean.layout);
+		return m2->ReadState(in);
+	}
+
+	int count = 1;
+	ImageBuffer mean;
+
+private:
+	// Null while M2 is zero everywhere
+	std::unique_ptr<ImageBuffer> m2;
+};
@@ -0,0 +1,232 @@
+#pragma once
+#include "Eigen/Core"
+#include "Philox.h"
+#include <cstdint>
+#include <memory>
+
+// Random numbers of the walks. A sampler belongs to one thread and is restarted for every
+// walk with StartWalk(key, walk), after which the walk draws its dimensions in order. What
+// a walk draws only depends on key and walk, so no state is shared between threads or
+// carried from one walk to the next, whichever thread or work item runs the walk.
+class Sampler
+{
+public:
+	virtual ~Sampler() {}
+
+	virtual void StartWalk(uint64_t key, uint64_t walk) = 0;
+
+	// Next dimension, uniform in [0, 1)
+	virtual double Next1D() = 0;
+
+	// Next two dimensions, uniform in [0, 1)^2
+	virtual Eigen::Vector2d Next2D()
+	{
+		double u = Next1D();
+		return Eigen::Vector2d(u, Next1D());
+	}
+
+	// Next n dimensions, in one call
+	virtual void Fill1D(double* values, int n)
+	{
+		for (int i = 0; i < n; ++i) { values[i] = Next1D(); }
+	}
+};
+
+// Philox streams, see Philox. Every 4 words (2 dimensions) are one block of the stream.
+class PhiloxSampler : public Sampler
+{
+public:
+	void StartWalk(uint64_t key, uint64_t walk) override { gen.Seek(key, walk); }
+
+	double Next1D() override { return gen.Next01(); }
+
+	Eigen::Vector2d Next2D() override
+	{
+		double u = gen.Next01();
+		return Eigen::Vector2d(u, gen.Next01());
+	}
+
+	void Fill1D(double* values, int n) override
+	{
+		for (int i = 0; i < n; ++i) { values[i] = gen.Next01(); }
+	}
+
+private:
+	Philox gen{ 0, 0 };
+};
+
+// xoshiro256+ (Blackman and Vigna 2018), 32 bytes of state and a few cycles per dimension.
+// The state of a walk is expanded from key and walk with splitmix64, so consecutive walks
+// get unrelated states. The lowest bits of xoshiro256+ are weak, only the top 53 are used.
+class XoshiroSampler : public Sampler
+{
+public:
+	void StartWalk(uint64_t key, uint64_t walk) override
+	{
+		uint64_t w = walk;
+		uint64_t seed = key ^ SplitMix(w);
+		for (int i = 0; i < 4; ++i) { s[i] = SplitMix(seed); }
+	}
+
+	double Next1D() override { return (Next() >> 11) * (1.0 / 9007199254740992.0); }
+
+	Eigen::Vector2d Next2D() override
+	{
+		double u = (Next() >> 11) * (1.0 / 9007199254740992.0);
+		return Eigen::Vector2d(u, (Next() >> 11) * (1.0 / 9007199254740992.0));
+	}
+
+	void Fill1D(double* values, int n) override
+	{
+		for (int i = 0; i < n; ++i) { values[i] = (Next() >> 11) * (1.0 / 9007199254740992.0); }
+	}
+
+private:
+	static inline uint64_t Rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+	// Advances x and returns its next output
+	static inline uint64_t SplitMix(uint64_t& x)
+	{
+		uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+	inline uint64_t Next()
+	{
+		const uint64_t result = s[0] + s[3];
+		const uint64_t t = s[1] << 17;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = Rotl(s[3], 45);
+		return result;
+	}
+
+	uint64_t s[4] = {};
+};
+
+// Quasi Monte Carlo: the first Dimensions dimensions of a walk are a Sobol point, Owen
+// scrambled with the hash based nested uniform scramble of Burley 2020, and the rest come from
+// the Philox stream of the walk. Walk WalkIndex(group, sample) takes point sample of the
+// sequence of (key, group), a pixel or the source or boundary walks of an estimate, so the
+// walks of a group fill the low dimensional part of their domain evenly: the pixel jitter and
+// the first steps of forward walks, the boundary and source samples and first splats of
+// reverse walks. Every dimension of every group and key is scrambled independently, so each
+// walk is still uniformly distributed and estimates stay unbiased and independent.
+class SobolSampler : public Sampler
+{
+public:
+	static constexpr int Dimensions = 16;
+
+	void StartWalk(uint64_t key, uint64_t walk) override
+	{
+		index = (uint32_t)walk;
+		uint64_t group = walk >> 32;
+		seed = Hash(key ^ Hash(group + 0x9E3779B97F4A7C15ull));
+		dimension = 0;
+		tail.Seek(key, walk);
+	}
+
+	double Next1D() override
+	{
+		if (dimension >= Dimensions) { return tail.Next01(); }
+		uint32_t x = NestedUniformScramble(SobolPoint(index, dimension), (uint32_t)Hash(seed + dimension));
+		++dimension;
+		return x * (1.0 / 4294967296.0);
+	}
+
+private:
+	// Coordinate dimension of point index, the direction numbers of Joe and Kuo (new-joe-kuo-6.21201)
+	static uint32_t SobolPoint(uint32_t index, int dimension)
+	{
+		static const DirectionTable table;
+		uint32_t x = 0;
+		for (int bit = 0; index; ++bit, index >>= 1) {
+			if (index & 1) { x ^= table.v[dimension][bit]; }
+		}
+		return x;
+	}
+
+	struct DirectionTable
+	{
+		uint32_t v[Dimensions][32];
+
+		DirectionTable()
+		{
+			// Degree s, coefficients a and initial numbers m of the primitive polynomial of dimensions 1, 2, ...
+			static const int s[Dimensions - 1] = { 1, 2, 3, 3, 4, 4, 5, 5, 5, 5, 5, 5, 6, 6, 6 };
+			static const int a[Dimensions - 1] = { 0, 1, 1, 2, 1, 4, 2, 4, 7, 11, 13, 14, 1, 13, 16 };
+			static const int m[Dimensions - 1][6] = {
+				{ 1 }, { 1, 3 }, { 1, 3, 1 }, { 1, 1, 1 }, { 1, 1, 3, 3 }, { 1, 3, 5, 13 },
+				{ 1, 1, 5, 5, 17 }, { 1, 1, 5, 5, 5 }, { 1, 1, 7, 11, 19 }, { 1, 1, 5, 1, 1 },
+				{ 1, 1, 1, 3, 11 }, { 1, 3, 5, 5, 31 }, { 1, 3, 3, 9, 7, 49 }, { 1, 1, 1, 15, 21, 21 },
+				{ 1, 3, 1, 13, 27, 49 } };
+
+			// Dimension 0 is the van der Corput sequence
+			for (int bit = 0; bit < 32; ++bit) { v[0][bit] = 1u << (31 - bit); }
+			for (int d = 1; d < Dimensions; ++d) {
+				const int deg = s[d - 1];
+				for (int bit = 0; bit < deg; ++bit) { v[d][bit] = (uint32_t)m[d - 1][bit] << (31 - bit); }
+				for (int bit = deg; bit < 32; ++bit) {
+					uint32_t x = v[d][bit - deg] ^ (v[d][bit - deg] >> deg);
+					for (int k = 1; k < deg; ++k) {
+						if ((a[d - 1] >> (deg - 1 - k)) & 1) { x ^= v[d][bit - k]; }
+					}
+					v[d][bit] = x;
+				}
+			}
+		}
+	};
+
+	static inline uint32_t ReverseBits(uint32_t x)
+	{
+		x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+		x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+		x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+		x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+		return (x >> 16) | (x << 16);
+	}
+
+	// Owen scramble: every bit is flipped by a hash of the bits above it
+	static inline uint32_t NestedUniformScramble(uint32_t x, uint32_t seed)
+	{
+		x = ReverseBits(x);
+		x += seed;
+		x ^= x * 0x6C50B47Cu;
+		x ^= x * 0xB82F1E52u;
+		x ^= x * 0xC7AFE638u;
+		x ^= x * 0x8D22F6E6u;
+		return ReverseBits(x);
+	}
+
+	// splitmix64 finalizer
+	static inline uint64_t Hash(uint64_t z)
+	{
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+	uint32_t index = 0;
+	uint64_t seed = 0;
+	int dimension = 0;
+	Philox tail{ 0, 0 };
+};
+
+// The generators a solver can draw its walks from
+enum class SamplerType {
+	Philox,  // Counter based, the default
+	Xoshiro, // Smaller state and cheaper per dimension
+	Sobol    // Scrambled Sobol points for the first dimensions of the walks of a group
+};
+
+inline std::unique_ptr<Sampler> MakeSampler(SamplerType type)
+{
+	if (type == SamplerType::Xoshiro) { return std::unique_ptr<Sampler>(new XoshiroSampler()); }
+	if (type == SamplerType::Sobol) { return std::unique_ptr<Sampler>(new SobolSampler()); }
+	return std::unique_ptr<Sampler>(new PhiloxSampler());
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include "Common.h"
+#include "ImageBuffer.h"
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#undef ReplaceFile // The Win32 ReplaceFile macro would rename ours
+#endif
+
+// Move the file from over to, replacing it. Readers of to see the old or the new file, never a
+// part, and to is never missing in between.
+inline bool ReplaceFile(const string& from, const string& to)
+{
+#ifdef _WIN32
+	// rename does not replace an existing file on Windows
+	return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+// Saves the latest estimate a solve has, which may only change between its batches, from a
+// background thread every seconds.
+// capture returns a copy of the estimate, or null when there is nothing to show yet, and
+// only holds the locks it needs for copying, so the workers of the solve keep running
+// and the file IO happens on this thread alone. Images go to a temporary file that is then
+// renamed to file. Stops when destroyed, without a last snapshot.
+class SnapshotWriter
+{
+public:
+	SnapshotWriter(const string& file, double seconds, std::function<std::unique_ptr<ImageBuffer>()> capture)
+		: file(file), seconds(seconds), capture(std::move(capture))
+	{
+		worker = std::thread([this] { Work(); });
+	}
+
+	SnapshotWriter(const SnapshotWriter&) = delete;
+	SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+	~SnapshotWriter()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		worker.join();
+	}
+
+private:
+	void Work()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		while (!wake.wait_for(guard, std::chrono::duration<double>(seconds), [this] { return stopping; })) {
+			guard.unlock();
+			std::unique_ptr<ImageBuffer> image = capture();
+			if (image) {
+				image->SaveImagePFM(file + ".tmp");
+				ReplaceFile(file + ".tmp", file);
+			}
+			guard.lock();
+		}
+	}
+
+	string file;
+	double seconds;
+	std::function<std::unique_ptr<ImageBuffer>()> capture;
+
+	std::thread worker;
+	std::mutex lock;
+	std::condition_variable wake;
+	bool stopping = false;
+};
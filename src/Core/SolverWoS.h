@@ -1,75 +1,58 @@
 #pragma once
 #include "PDE.h"
 #include "ImageBuffer.h"
+#include "PixelStatistics.h"
+#include "ThreadPool.h"
+#include "WorkStealing.h"
+#include "Snapshot.h"
+#include "Wavefront.h"
+#include "WalkPacket.h"
+#include <cstdio>
+#include <stdexcept>
 
 constexpr bool UseSameSeed = true;
 
-void ReleativeSD(string prefixname, int start, int end) 
-{
-	// Calculate avg
-	ImageBuffer temp(prefixname + to_string(start) + ".pfm");
-	int resolution = temp.res;
-	ImageBuffer avg(resolution);
-	ImageBuffer var(resolution);
-	ImageBuffer rsd(resolution);
-
-	// Avg
-	for (int i = start; i <= end; ++i)
-	{
-		ImageBuffer temp(prefixname + to_string(i) + ".pfm");
-		for (int i = 0; i < resolution; ++i) {
-			for (int j = 0; j < resolution; ++j) {
-				avg.buffer[i][j] += temp.buffer[i][j];
-			}
-		}
-	}
-
-	for (int i = 0; i < resolution; ++i) {
-		for (int j = 0; j < resolution; ++j) {
-			avg.buffer[i][j] /= (end - start + 1);
-		}
-	}
-	avg.SaveImagePFM(prefixname + "Avg" + ".pfm");
+// How the worker threads of SolveMultiThread store their results
+enum class AccumulationMode {
+	PerThread, // Every thread owns a full image, per-thread results are saved and averaged
+	Shared,    // All threads write into one image guarded by tile locks, memory does not grow with threads
+	Tiles      // One image per batch. Every tile and thread result is a work item, idle threads steal
+	           // them, so pixels get numberThread estimates whatever the pool size. Solvers without SolveTile run PerThread
+};
 
-	// Variance
-#ifdef CALCULATE_VARIANCE
-	for (int i = start; i <= end; ++i)
-	{
-		ImageBuffer temp(prefixname + to_string(i) + ".pfm");
-		for (int i = 0; i < resolution; ++i) {
-			for (int j = 0; j < resolution; ++j) {
-				Vec3 t = temp.buffer[i][j] - avg.buffer[i][j];
-				var.buffer[i][j] += Vec3{ t[0] * t[0], t[1] * t[1], t[2] * t[2] };
-			}
-		}
-	}
+// When a solve stops adding batches, every limit that is set ends it. SolveMultiThread runs a
+// fixed number of batches, SolveProgressive runs until a wall clock budget is spent or the
+// mean relative standard error of the estimate (PixelStatistics::MeanReleativeError) is reached.
+struct StopCondition {
+	int Batches = 0;        // 0 for no limit
+	double Seconds = 0.0;   // 0 for no limit, checked after every batch
+	double TargetRSD = 0.0; // 0 for no target, needs the statistics of PerThread or Tiles
+	bool Publish = false;   // Save the current estimate after every batch
+};
 
-	for (int i = 0; i < resolution; ++i) {
-		for (int j = 0; j < resolution; ++j) {
-			var.buffer[i][j] /= (end - start);
-		}
+// Merge the statistics into the first one along a binary tree, the pairs of a level merge in parallel
+void ReduceStatistics(std::vector<PixelStatistics>& stats, ThreadPool& pool)
+{
+	for (size_t stride = 1; stride < stats.size(); stride *= 2) {
+		int pairs = int((stats.size() - stride + 2 * stride - 1) / (2 * stride));
+		pool.Run(pairs, [&](int pair) {
+			size_t i = pair * 2 * stride;
+			stats[i].Merge(stats[i + stride]);
+		});
 	}
+}
 
-	// Releative standard deviation
-	for (int i = 0; i < resolution; ++i) {
-		for (int j = 0; j < resolution; ++j) {
-			const auto& v = var.buffer[i][j];
-			const auto& a = avg.buffer[i][j];
-			rsd.buffer[i][j] = Vec3{ sqrt(v[0]) / a[0], sqrt(v[1]) / a[1] , sqrt(v[2]) / a[2] };
-		}
-	}
+// Save the variance and the releative standard deviation of the samples next to prefixname
+void ReleativeSD(string prefixname, const PixelStatistics& stats)
+{
+	ImageBuffer var(stats.mean.window, stats.mean.layout);
+	ImageBuffer rsd(stats.mean.window, stats.mean.layout);
+	stats.mean.ForEachStoredPixel([&](int index) {
+		var.SetColor(index, stats.Variance(index));
+		rsd.SetColor(index, stats.ReleativeSD(index));
+	});
 	var.SaveImagePFM(prefixname + "Var" + ".pfm");
 	rsd.SaveImagePFM(prefixname + "RSD" + ".pfm");
-#endif // CALCULATE_VARIANCE
-
-#ifndef KEEP_THREAD_RESULTS
-	// Remove results from all threads
-	for (int i = start; i <= end; ++i)
-	{	
-		string file_name = prefixname + to_string(i) + ".pfm";
-		std::remove(file_name.c_str());
-	}
-#endif
 }
 
 class DrawPDE
@@ -78,22 +61,25 @@ public:
 	static constexpr int Samples = 16;
 	static constexpr double m_DrawBoundaryEpsilon = 0.8 * 1e-2;
 
-	static void Draw(const PoissonEquation& equation)
+	static void Draw(const PoissonEquation& equation, const Window& window = Window())
 	{
 
 		ptrSourceTerm source = equation.Source;
 		ptrBoundary boundary = equation.Boundary;
-		ImageBuffer buffer(DefaultResolution);
-		std::mt19937 gen(0);
+		ImageBuffer buffer(window);
+		PhiloxSampler sampler;
+		sampler.StartWalk(0, 0);
 
 
-		for (int i = 0; i < buffer.res; ++i) {
-			for (int j = 0; j < buffer.res; ++j) {
+		for (int i = 0; i < buffer.width; ++i) {
+			for (int j = 0; j < buffer.height; ++j) {
+				if (!window.Wanted(i, j)) { continue; }
 				for (int sample = 0; sample < Samples; ++sample) {
 
 					Vec2 pos = buffer.img2world({ i, j });
-					double dx = (Rand01(gen) - 0.5) * buffer.pixel_size;
-					double dy = (Rand01(gen) - 0.5) * buffer.pixel_size;
+					Vec2 u = sampler.Next2D();
+					double dx = (u[0] - 0.5) * buffer.pixel_size;
+					double dy = (u[1] - 0.5) * buffer.pixel_size;
 					pos = pos + Vec2{ dx, dy };
 					ClosePoint cp = equation.Boundary->GetClosestPoint(pos);
 
@@ -128,67 +114,572 @@ public:
 	static constexpr int MaxPathLength = 1000;
 	int m_CurrentBatch = 0;
 
-	void SolveMultiThread(const PoissonEquation& equation, int numberThread = 16, int batch = 1)
+	// Part of the scene the output images show, the whole scene at DefaultResolution by default
+	Window m_Window;
+
+	// Memory layout of the output images, tiles keep the rows of a splat close together
+	PixelLayout m_Layout = PixelLayout::RowMajor;
+
+	// Per-pixel mean and variance over the thread results of SolveMultiThread,
+	// updated after every batch
+	std::shared_ptr<PixelStatistics> m_Statistics;
+
+	// Workers of the solves. Solvers given the same pool reuse its threads, one without
+	// a pool starts numberThread threads on its first solve and keeps them for the next.
+	// numberThread stays the number of thread results per batch either way.
+	ThreadPool* m_Pool = nullptr;
+
+	// File the state of a running solve is saved to after every CheckpointInterval batches,
+	// empty for none: the batch count, the time used and the statistics (the accumulated image
+	// in the Shared mode). A solve of the same solver, mode and thread count that finds the file
+	// resumes after the saved batch, and removes it once it completes. The generators of a batch
+	// are seeded from its index (GetThreadSeed), so a resumed solve draws the same walks as one
+	// that never stopped.
+	string CheckpointFile;
+	int CheckpointInterval = 1;
+
+	// Save the current estimate as <name>Snapshot.pfm every SnapshotSeconds while a batched solve
+	// runs, 0 for none. A background thread copies it and writes the file, the workers never
+	// wait for it. Only Tiles snapshots show the running batch, with every tile estimate done so
+	// far. PerThread and Shared snapshots hold the finished batches and change once per batch, so
+	// they write nothing before the first batch ends, which for a solve of one batch, or a reverse
+	// solve asked for Tiles, is the end of the solve.
+	double SnapshotSeconds = 0.0;
+
+	// Generator of the walks, every thread draws from a sampler of its own (MakeSampler)
+	// Sobol spreads the walks of a pixel, or of an estimate in reverse, over their first dimensions
+	SamplerType Generator = SamplerType::Philox;
+
+	// Run the walks of Solve, SolveTile and SolveChunks on a WavefrontWalks with up to
+	// WavefrontWidth walks in flight instead of one walk after the other. Same walks, same result
+	// up to the order of summation.
+	bool Wavefront = false;
+	int WavefrontWidth = 4096;
+
+	// Or in a WalkPacket of PacketWidth (4, 8 or 16) walks in lockstep, 0 for none. Other widths
+	// make the solve throw std::invalid_argument.
+	int PacketWidth = 0;
+
+	void SolveMultiThread(const PoissonEquation& equation, int numberThread = 16, int batch = 1,
+						  AccumulationMode mode = AccumulationMode::PerThread)
+	{
+		StopCondition stop;
+		stop.Batches = batch;
+		SolveBatches(equation, numberThread, stop, mode);
+	}
+
+	// Add batches until seconds of wall clock time are used or the mean relative standard error
+	// of the estimate is down to targetRSD, 0 disabling either limit. The current estimate is
+	// saved as <name>Progress.pfm after every batch. The error is only known with the statistics
+	// of the PerThread and Tiles modes, and from the second thread result on. A solve without a
+	// usable limit does nothing.
+	void SolveProgressive(const PoissonEquation& equation, int numberThread, double seconds, double targetRSD,
+						  AccumulationMode mode = AccumulationMode::PerThread)
+	{
+		StopCondition stop;
+		stop.Seconds = seconds;
+		stop.TargetRSD = targetRSD;
+		stop.Publish = true;
+		SolveBatches(equation, numberThread, stop, mode);
+	}
+
+	void SolveBatches(const PoissonEquation& equation, int numberThread, const StopCondition& stop, AccumulationMode mode)
 	{
+		if (!Bounded(stop, mode))
+		{
+			std::cout << GetName() << " solve has no batch, time or usable error limit, nothing solved" << std::endl;
+			return;
+		}
+		if (mode == AccumulationMode::Shared)
+		{
+			SolveShared(equation, numberThread, stop);
+			return;
+		}
+		if (mode == AccumulationMode::Tiles)
+		{
+			if (SupportsTiles())
+			{
+				SolveTiles(equation, numberThread, stop);
+				return;
+			}
+			std::cout << GetName() << " has no SolveTile, solve with per-thread images instead of tiles" << std::endl;
+			mode = AccumulationMode::PerThread;
+		}
+
 		string name = WorkDirectory + GetName();
 		
 		double time_used = 0;
 
-		for (m_CurrentBatch = 0; m_CurrentBatch < batch; ++m_CurrentBatch) {
+		ThreadPool& pool = GetPool(numberThread);
+		m_Statistics.reset();
+		m_CurrentBatch = 0;
+		LoadCheckpoint(AccumulationMode::PerThread, numberThread, time_used);
+		auto snapshots = StartSnapshots(name, numberThread);
+
+		for (; !Done(stop, AccumulationMode::PerThread, time_used); ++m_CurrentBatch) {
 			auto start = std::chrono::system_clock::now();
-			std::vector<ImageBuffer> bufferList(numberThread, ImageBuffer(DefaultResolution));
-			std::vector<std::thread> threadList(numberThread);
+			BeginBatch(numberThread);
+			std::vector<ImageBuffer> bufferList(numberThread, ImageBuffer(m_Window, m_Layout));
+			for (auto& img : bufferList)
+			{
+				InitBuffer(img);
+			}
+			pool.Run(numberThread, [&](int id) { this->Solve(equation, &bufferList[id], id); });
 
-			for (int id = 0; id < numberThread; ++id)
+			for (auto& img : bufferList)
 			{
-				ImageBuffer* buffer = &(bufferList[id]);
-				threadList[id] = std::thread([this, equation, buffer, id] { this->Solve(equation, buffer, id); });
+				img.ResolveSplats();
+			}
+			// Threads that split one estimate hold uneven parts of it, only their sum is a sample
+			if (ThreadsShareEstimate())
+			{
+				ImageBuffer& sum = bufferList[0];
+				for (int id = 1; id < numberThread; ++id)
+				{
+					const ImageBuffer& img = bufferList[id];
+					img.ForEachStoredPixel([&](int index) {
+						double* v = sum.PixelData(index);
+						const double* a = img.PixelData(index);
+						for (int c = 0; c < ImageBuffer::Channels; ++c) { v[c] += a[c]; }
+					});
+				}
+				bufferList.erase(bufferList.begin() + 1, bufferList.end());
 			}
-			
-			for (auto& t : threadList)
+			for (auto& img : bufferList)
 			{
-				t.join();
+				NormalizeBuffer(equation, img, EstimatesPerBatch(numberThread) / bufferList.size());
 			}
+
+#ifdef KEEP_THREAD_RESULTS
+			for (int id = 0; id < (int)bufferList.size(); ++id)
+			{
+				auto& img = bufferList[id];
+				img.SaveImagePFM(name + to_string(m_CurrentBatch * (int)bufferList.size() + id) + ".pfm");
+			}
+#endif
+			// Every thread result, or the sum of a batch of threads sharing an estimate, is one
+			// sample of the per-pixel statistics
+			std::vector<PixelStatistics> stats;
+			for (auto& img : bufferList) { stats.emplace_back(std::move(img)); }
+			ReduceStatistics(stats, pool);
+			MergeStatistics(std::move(stats[0]));
+
 			auto end = std::chrono::system_clock::now();
 			std::chrono::duration<double> elapsed_seconds = end - start;
 			std::cout << "Finish batch: " << m_CurrentBatch << " elapsed time: " << elapsed_seconds.count() << std::endl;
 			time_used += elapsed_seconds.count();
 
 			Log();
+			Publish(stop, name);
+			SaveCheckpoint(AccumulationMode::PerThread, numberThread, time_used);
+		}
+		SaveStatistics(name, time_used);
+		RemoveCheckpoint();
+	}
 
-			for (int id = 0; id < numberThread; ++id)
-			{
-				auto& img = bufferList[id];
-				img.SaveImagePFM(name + to_string(m_CurrentBatch * numberThread + id) + ".pfm");
+	// One image per batch holding numberThread estimates of every pixel. A work item is one
+	// estimate of one tile, the pool threads steal items from each other and every item adds
+	// its tile at once, so threads only meet when two estimates of a tile end together.
+	// Every batch image is one sample of the statistics.
+	void SolveTiles(const PoissonEquation& equation, int numberThread, const StopCondition& stop)
+	{
+		string name = WorkDirectory + GetName();
+
+		double time_used = 0;
+		ThreadPool& pool = GetPool(numberThread);
+		m_Statistics.reset();
+		m_CurrentBatch = 0;
+		LoadCheckpoint(AccumulationMode::Tiles, numberThread, time_used);
+		auto snapshots = StartSnapshots(name, numberThread);
+
+		for (; !Done(stop, AccumulationMode::Tiles, time_used); ++m_CurrentBatch) {
+			auto start = std::chrono::system_clock::now();
+			BeginBatch(numberThread);
+			ImageBuffer img(m_Window, m_Layout);
+			InitBuffer(img);
+			img.EnableConcurrentWrites();
+
+			// Items of a tile are adjacent, so a worker mostly runs all estimates of its tiles
+			int tiles = img.tiles_x * img.tiles_y;
+			SetLiveTiles(&img);
+			WorkStealingScheduler::Run(pool, tiles * numberThread, [&](int item) {
+				SolveTile(equation, &img, item / numberThread, item % numberThread);
+			});
+			SetLiveTiles(nullptr);
+			img.ResolveSplats();
+			NormalizeBuffer(equation, img, EstimatesPerBatch(numberThread));
+			MergeStatistics(PixelStatistics(std::move(img)));
+
+			auto end = std::chrono::system_clock::now();
+			std::chrono::duration<double> elapsed_seconds = end - start;
+			std::cout << "Finish batch: " << m_CurrentBatch << " elapsed time: " << elapsed_seconds.count() << std::endl;
+			time_used += elapsed_seconds.count();
+
+			Log();
+			Publish(stop, name);
+			SaveCheckpoint(AccumulationMode::Tiles, numberThread, time_used);
+		}
+		SaveStatistics(name, time_used);
+		RemoveCheckpoint();
+	}
+
+	// Every thread of every batch accumulates into the same image, which is only
+	// normalized once at the end. No per-thread images, so no variance estimate.
+	void SolveShared(const PoissonEquation& equation, int numberThread, const StopCondition& stop)
+	{
+		string name = WorkDirectory + GetName();
+
+		double time_used = 0;
+		ThreadPool& pool = GetPool(numberThread);
+		ImageBuffer shared(m_Window, m_Layout);
+		InitBuffer(shared);
+		shared.EnableConcurrentWrites();
+		{
+			// Statistics of an earlier solve would end this one and show in its snapshots
+			std::lock_guard<std::mutex> guard(m_SnapshotLock);
+			m_Statistics.reset();
+		}
+		m_CurrentBatch = 0;
+		LoadCheckpoint(AccumulationMode::Shared, numberThread, time_used, &shared);
+		auto snapshots = StartSnapshots(name, numberThread);
+
+		for (; !Done(stop, AccumulationMode::Shared, time_used); ++m_CurrentBatch) {
+			auto start = std::chrono::system_clock::now();
+			BeginBatch(numberThread);
+			pool.Run(numberThread, [&](int id) { this->Solve(equation, &shared, id); });
+			auto end = std::chrono::system_clock::now();
+			std::chrono::duration<double> elapsed_seconds = end - start;
+			std::cout << "Finish batch: " << m_CurrentBatch << " elapsed time: " << elapsed_seconds.count() << std::endl;
+			time_used += elapsed_seconds.count();
+
+			Log();
+			if (stop.Publish || snapshots) {
+				// A copy keeps its own postponed splats, the shared image goes on unresolved
+				auto current = std::make_unique<ImageBuffer>(shared);
+				current->ResolveSplats();
+				NormalizeBuffer(equation, *current, (m_CurrentBatch + 1) * EstimatesPerBatch(numberThread));
+				if (stop.Publish) { current->SaveImagePFM(name + "Progress.pfm"); }
+				std::lock_guard<std::mutex> guard(m_SnapshotLock);
+				m_SharedEstimate = std::move(current);
 			}
-			
+			SaveCheckpoint(AccumulationMode::Shared, numberThread, time_used, &shared);
 		}
-		ReleativeSD(name, 0, batch * numberThread - 1);
-		
-		// Add time to the file name
-		ImageBuffer avg(name + "Avg" + ".pfm");
+		snapshots.reset();
+		m_SharedEstimate.reset();
+		shared.ResolveSplats();
+		NormalizeBuffer(equation, shared, m_CurrentBatch * EstimatesPerBatch(numberThread));
 
-		// https://stackoverflow.com/questions/29200635/convert-float-to-string-with-precision-number-of-decimal-digits-specified
 		std::stringstream s1;
 		s1 << std::fixed << std::setprecision(2) << time_used;
 		std::string t = s1.str();
-		avg.SaveImagePFM(name + "_Time" + t + "s.pfm");
-		std::remove((name + "Avg" + ".pfm").c_str());
+		shared.SaveImagePFM(name + "_Time" + t + "s.pfm");
+		RemoveCheckpoint();
+	}
+
+	// Set up the options of a fresh output image before any thread writes to it
+	virtual void InitBuffer(ImageBuffer& buffer) { }
+
+	// Called before the threads of every batch start
+	virtual void BeginBatch(int numberThread) { }
+
+	// Number of complete estimates the numberThread thread results of a batch add up to.
+	// One per thread unless the threads split the work of a single estimate.
+	virtual double EstimatesPerBatch(int numberThread) { return numberThread; }
+
+	// Whether the threads of a batch split the work of one estimate between them unevenly, so the
+	// PerThread mode has to add their images up before normalizing them as one sample
+	virtual bool ThreadsShareEstimate() const { return false; }
+
+	// Turn the sum of estimateCount estimates into the final estimate. Per-thread
+	// images are normalized on their own, with estimateCount = 1 when each thread
+	// computes a complete estimate and a fraction when it only computes a part.
+	virtual void NormalizeBuffer(const PoissonEquation& equation, ImageBuffer& buffer, double estimateCount)
+	{
+		if (estimateCount == 1) { return; }
+		buffer.ForEachStoredPixel([&](int index) {
+			buffer.SetColor(index, buffer.GetColor(index) / estimateCount);
+		});
 	}
 
 	virtual void Solve(const PoissonEquation& equation, ImageBuffer* buffer, int id) = 0;
 
+	// Whether SolveTile is implemented, the Tiles mode falls back to PerThread otherwise
+	virtual bool SupportsTiles() const { return false; }
+
+	// Add estimate id of the pixels of tile (index of the tile grid of the buffer) to buffer,
+	// under its tile lock, and call CountTileEstimate(tile) while holding it. The tiles of
+	// estimate id draw the same walks as Solve(equation, buffer, id).
+	virtual void SolveTile(const PoissonEquation& equation, ImageBuffer* buffer, int tile, int id)
+	{
+		assert(false && "Shouldn't call here");
+	}
+
 	virtual string GetName() { return "VirtualClass"; }
+
+	// Settings the estimates depend on, checkpoints only resume a solve that writes the same
+	virtual void WriteSettings(std::ostream& out) const
+	{
+		WriteBinary(out, m_Epsilon);
+		WriteBinary(out, (int)Generator);
+		WriteBinary(out, (int)m_Layout);
+		for (int i = 0; i < 2; ++i) {
+			WriteBinary(out, m_Window.lower[i]);
+			WriteBinary(out, m_Window.upper[i]);
+		}
+		WriteBinary(out, m_Window.width);
+		WriteBinary(out, m_Window.height);
+		WriteBinary(out, m_Window.mask ? (int)m_Window.mask->size() : 0);
+		if (m_Window.mask) { out.write((const char*)m_Window.mask->data(), m_Window.mask->size()); }
+	}
 	virtual void Log() { }
 	
-	int GetThreadSeed(int id) {
+	// Whether some limit of stop ends the solve, the error target needs the statistics the Shared mode lacks
+	static bool Bounded(const StopCondition& stop, AccumulationMode mode) {
+		return stop.Batches > 0 || stop.Seconds > 0.0 || (stop.TargetRSD > 0.0 && mode != AccumulationMode::Shared);
+	}
+
+	// Checked before every batch, m_CurrentBatch batches being done
+	bool Done(const StopCondition& stop, AccumulationMode mode, double time_used) {
+		if (stop.Batches > 0 && m_CurrentBatch >= stop.Batches) { return true; }
+		if (stop.Seconds > 0.0 && time_used >= stop.Seconds) { return true; }
+		if (stop.TargetRSD > 0.0 && mode != AccumulationMode::Shared && m_Statistics) {
+			double rsd = m_Statistics->MeanReleativeError();
+			if (stop.Publish) { std::cout << "Mean relative error: " << rsd << std::endl; }
+			if (rsd <= stop.TargetRSD) { return true; }
+		}
+		return false;
+	}
+
+	void Publish(const StopCondition& stop, const string& name) {
+		if (stop.Publish) { m_Statistics->mean.SaveImagePFM(name + "Progress.pfm"); }
+	}
+
+	void MergeStatistics(PixelStatistics&& batch) {
+		std::lock_guard<std::mutex> guard(m_SnapshotLock);
+		if (m_Statistics) {
+			m_Statistics->Merge(batch);
+		} else {
+			m_Statistics = std::make_shared<PixelStatistics>(std::move(batch));
+		}
+	}
+
+	// Save the mean, with the time in the file name, and the noise maps
+	void SaveStatistics(const string& name, double time_used) {
+		ReleativeSD(name, *m_Statistics);
+
+		// https://stackoverflow.com/questions/29200635/convert-float-to-string-with-precision-number-of-decimal-digits-specified
+		std::stringstream s1;
+		s1 << std::fixed << std::setprecision(2) << time_used;
+		std::string t = s1.str();
+		m_Statistics->mean.SaveImagePFM(name + "_Time" + t + "s.pfm");
+	}
+
+	// Called after batch m_CurrentBatch. The state goes to a temporary file first, so a solve
+	// killed while writing leaves the previous checkpoint. The unnormalized shared image is
+	// saved with its postponed splats resolved, which is as good as resolving them at the end.
+	void SaveCheckpoint(AccumulationMode mode, int numberThread, double time_used, ImageBuffer* shared = nullptr) {
+		int batches = m_CurrentBatch + 1;
+		if (CheckpointFile.empty() || batches % max(1, CheckpointInterval) != 0) { return; }
+		string temp = CheckpointFile + ".tmp";
+		{
+			std::ofstream out(temp, std::ios::binary);
+			WriteCheckpointHeader(out, mode, numberThread);
+			WriteBinary(out, batches);
+			WriteBinary(out, time_used);
+			if (shared) {
+				shared->ResolveSplats();
+				shared->WriteState(out);
+			} else {
+				m_Statistics->WriteState(out);
+			}
+			if (!out) {
+				std::cout << "Failed to write checkpoint " << temp << std::endl;
+				return;
+			}
+		}
+		if (!ReplaceFile(temp, CheckpointFile)) {
+			std::cout << "Failed to replace checkpoint " << CheckpointFile << std::endl;
+		}
+	}
+
+	// Restore m_CurrentBatch, time_used and the statistics, or add the saved image to the fresh
+	// shared image, from CheckpointFile. A missing file or one of another solve starts from scratch.
+	bool LoadCheckpoint(AccumulationMode mode, int numberThread, double& time_used, ImageBuffer* shared = nullptr) {
+		if (CheckpointFile.empty()) { return false; }
+		std::ifstream in(CheckpointFile, std::ios::binary);
+		if (!in) { return false; }
+
+		std::stringstream expected;
+		WriteCheckpointHeader(expected, mode, numberThread);
+		string header(expected.str().size(), '\0');
+		int batches = 0;
+		double seconds = 0.0;
+		bool ok = in.read(&header[0], header.size()) && header == expected.str()
+			&& ReadBinary(in, batches) && ReadBinary(in, seconds);
+
+		ImageBuffer image(m_Window, m_Layout);
+		auto stats = std::make_shared<PixelStatistics>(ImageBuffer(m_Window, m_Layout));
+		ok = ok && (shared ? image.ReadState(in) : stats->ReadState(in));
+		if (!ok) {
+			std::cout << "Ignore checkpoint " << CheckpointFile << " of another solve" << std::endl;
+			return false;
+		}
+
+		if (shared) {
+			image.ForEachStoredPixel([&](int index) {
+				double* v = shared->PixelData(index);
+				const double* a = image.PixelData(index);
+				for (int c = 0; c < ImageBuffer::Channels; ++c) { v[c] += a[c]; }
+			});
+		} else {
+			m_Statistics = stats;
+		}
+		m_CurrentBatch = batches;
+		time_used = seconds;
+		std::cout << "Resume " << GetName() << " after batch " << batches - 1 << std::endl;
+		return true;
+	}
+
+	void RemoveCheckpoint() {
+		if (!CheckpointFile.empty()) { std::remove(CheckpointFile.c_str()); }
+	}
+
+	// One more estimate was added to tile of the running SolveTiles batch, under the tile lock
+	void CountTileEstimate(int tile) {
+		if (!m_TileEstimates.empty()) { ++m_TileEstimates[tile]; }
+	}
+
+	// Null unless SnapshotSeconds is set. The snapshots stop when it is destroyed.
+	std::unique_ptr<SnapshotWriter> StartSnapshots(const string& name, int numberThread) {
+		if (SnapshotSeconds <= 0.0) { return nullptr; }
+		return std::make_unique<SnapshotWriter>(name + "Snapshot.pfm", SnapshotSeconds,
+			[this, numberThread] { return CaptureSnapshot(numberThread); });
+	}
+
+	// Copy of the current estimate, null before there is one: the finished batches and, in
+	// SolveTiles, the tiles of the running one. Runs on the snapshot thread,
+	// the solve only waits for it while merging a batch.
+	std::unique_ptr<ImageBuffer> CaptureSnapshot(int numberThread) {
+		std::lock_guard<std::mutex> guard(m_SnapshotLock);
+		if (m_SharedEstimate) { return std::make_unique<ImageBuffer>(*m_SharedEstimate); }
+		if (!m_Statistics && !m_LiveTiles) { return nullptr; }
+
+		auto image = m_Statistics ? std::make_unique<ImageBuffer>(m_Statistics->mean)
+			: std::make_unique<ImageBuffer>(m_Window, m_Layout);
+		if (!m_LiveTiles) { return image; }
+
+		// Every tile is weighed in with the estimates it holds so far, which are read
+		// together with its pixels under the tile lock. Normalizing divides by the count.
+		const ImageBuffer& live = *m_LiveTiles;
+		const double done = m_Statistics ? m_Statistics->count * EstimatesPerBatch(numberThread) : 0.0;
+		std::vector<double> pixels(ImageBuffer::Channels * ImageBuffer::TilePixels);
+		for (int tile = 0; tile < (int)m_TileEstimates.size(); ++tile) {
+			const int x0 = (tile % live.tiles_x) * ImageBuffer::TileSize, y0 = (tile / live.tiles_x) * ImageBuffer::TileSize;
+			const int x1 = min(live.width, x0 + ImageBuffer::TileSize), y1 = min(live.height, y0 + ImageBuffer::TileSize);
+			int estimates;
+			{
+				TileGuard tileGuard(live.GetTileLock(x0, y0));
+				estimates = m_TileEstimates[tile];
+				if (estimates == 0) { continue; }
+				for (int y = y0; y < y1; ++y) {
+					for (int x = x0; x < x1; ++x) {
+						const double* v = live.PixelData(live.PixelIndex(x, y));
+						std::copy(v, v + ImageBuffer::Channels, &pixels[ImageBuffer::Channels * ((y - y0) * ImageBuffer::TileSize + x - x0)]);
+					}
+				}
+			}
+			for (int y = y0; y < y1; ++y) {
+				for (int x = x0; x < x1; ++x) {
+					double* a = image->PixelData(image->PixelIndex(x, y));
+					const double* b = &pixels[ImageBuffer::Channels * ((y - y0) * ImageBuffer::TileSize + x - x0)];
+					for (int c = 0; c < ImageBuffer::Channels; ++c) { a[c] = (a[c] * done + b[c]) / (done + estimates); }
+				}
+			}
+		}
+		return image;
+	}
+
+	// Let snapshots read the batch image of SolveTiles while it is computed, null once it is done
+	void SetLiveTiles(const ImageBuffer* img) {
+		std::lock_guard<std::mutex> guard(m_SnapshotLock);
+		m_TileEstimates.assign(img ? img->tiles_x * img->tiles_y : 0, 0);
+		m_LiveTiles = img;
+	}
+
+	ThreadPool& GetPool(int numberThread) {
+		if (m_Pool) { return *m_Pool; }
+		if (!m_OwnPool || m_OwnPool->Size() != max(1, numberThread)) {
+			m_OwnPool = std::make_shared<ThreadPool>(numberThread);
+		}
+		return *m_OwnPool;
+	}
+
+	// Key of the random streams of estimate id of the current batch. Walk sample of group (a pixel,
+	// or the source or boundary walks) draws from StartWalk(key, WalkIndex(group, sample)) of a
+	// sampler, so an estimate only depends on its batch and id, whichever thread or work item runs it.
+	uint64_t GetThreadSeed(int id) {
 		if (UseSameSeed) { 
-			return id * 173 + 1363 * (m_CurrentBatch + 1);
+			return ((uint64_t)(m_CurrentBatch + 1) << 32) | (uint32_t)id;
 		} else {
-			int seed = rd();
-			return seed;
+			return ((uint64_t)rd() << 32) | rd();
 		}
 	}
 
-	
+	std::unique_ptr<Sampler> MakeSampler() const { return ::MakeSampler(Generator); }
+
+	// Whether the walks run on RunWalks instead of one after the other
+	bool BatchedWalks() const { return Wavefront || PacketWidth > 0; }
+
+	// The walks next hands out (at most count) on the engine Wavefront and PacketWidth select,
+	// see WavefrontWalks::Run for the stages
+	template <typename Next, typename Start, typename Visit, typename Finish>
+	void RunWalks(const Boundary& boundary, double far, int count, Next next, Start start, Visit visit, Finish finish) const
+	{
+		if (Wavefront) {
+			WavefrontWalks engine(Generator, min(WavefrontWidth, count));
+			engine.Run(boundary, MaxPathLength, m_Epsilon, far, next, start, visit, finish);
+		} else if (PacketWidth == 4) {
+			WalkPacket<4> engine(Generator);
+			engine.Run(boundary, MaxPathLength, m_Epsilon, far, next, start, visit, finish);
+		} else if (PacketWidth == 8) {
+			WalkPacket<8> engine(Generator);
+			engine.Run(boundary, MaxPathLength, m_Epsilon, far, next, start, visit, finish);
+		} else if (PacketWidth == 16) {
+			WalkPacket<16> engine(Generator);
+			engine.Run(boundary, MaxPathLength, m_Epsilon, far, next, start, visit, finish);
+		} else {
+			// Thrown on the worker, the pool rethrows it to the solve
+			throw std::invalid_argument("PacketWidth " + std::to_string(PacketWidth) + " is not 4, 8 or 16");
+		}
+	}
+
+	static uint64_t WalkIndex(int group, int sample) {
+		return ((uint64_t)(uint32_t)group << 32) | (uint32_t)sample;
+	}
+
+
+	// Pool started by GetPool when m_Pool is not set
+	std::shared_ptr<ThreadPool> m_OwnPool;
+
+	// What snapshots read: m_Statistics, the latest estimate of SolveShared and the
+	// running batch of SolveTiles with the estimates of every tile, guarded by m_SnapshotLock
+	// except for the tile counts, which go with the tile locks
+	std::mutex m_SnapshotLock;
+	std::unique_ptr<ImageBuffer> m_SharedEstimate;
+	const ImageBuffer* m_LiveTiles = nullptr;
+	std::vector<int> m_TileEstimates;
+
+private:
+	// What a checkpoint has to match to be resumed
+	void WriteCheckpointHeader(std::ostream& out, AccumulationMode mode, int numberThread) {
+		const int version = 2;
+		out.write("WoSC", 4);
+		WriteBinary(out, version);
+		WriteBinary(out, (int)mode);
+		WriteBinary(out, numberThread);
+		string name = GetName();
+		WriteBinary(out, (int)name.size());
+		out.write(name.data(), name.size());
+		WriteSettings(out);
+	}
 };
\ No newline at end of file
@@ -2,15 +2,6 @@
 #include "Common.h"
 #include "ImageBuffer.h"
 
-//class Sampler {
-//	virtual Vec2 Sample(const Vec2& p, double r, std::mt19937& gen)
-//	{
-//		return SampleGreen(p, r, gen);
-//	}
-//};
-
-
-
 struct PointSource {
 	Vec2 pos;
 	Vec3 source;
@@ -29,11 +20,11 @@ public:
 
 	// Sample Source points used for reverse
 	// pdf : the pdf of sampling this pointsource
-	virtual PointSource SampleSource(std::mt19937& gen, double& pdf) const = 0;
+	virtual PointSource SampleSource(Sampler& sampler, double& pdf) const = 0;
 
 
 	// Integrate Sphere according to source sampling
-	virtual Vec3 IntegrateSphere(const Vec2& p, const double& r, std::mt19937& gen) const = 0;
+	virtual Vec3 IntegrateSphere(const Vec2& p, const double& r, Sampler& sampler) const = 0;
 
 
 	virtual bool HasSource() const { return false; }
@@ -45,13 +36,13 @@ public:
 class EmptySource : public SourceTerm
 {
 public:
-	PointSource SampleSource(std::mt19937& gen, double& pdf) const override
+	PointSource SampleSource(Sampler& sampler, double& pdf) const override
 	{
 		assert(false && "Shouldn't call here");
 		return PointSource();
 	}
 
-	Vec3 IntegrateSphere(const Vec2& p, const double& r, std::mt19937& gen) const override
+	Vec3 IntegrateSphere(const Vec2& p, const double& r, Sampler& sampler) const override
 	{
 		assert(false && "Shouldn't call here");
 		return { 0.0, 0.0, 0.0 };
@@ -68,16 +59,16 @@ public:
 	bool IsDiscrete() const override { return true; }
 	bool HasSource() const override { return true; }
 
-	PointSource SampleSource(std::mt19937& gen, double& pdf) const override 
+	PointSource SampleSource(Sampler& sampler, double& pdf) const override 
 	{
 		// Uniform boundary
-		/*double dx = 2.0 * (Rand01(gen) - 0.5) * ScreenSize;
-		double dy = 2.0 * (Rand01(gen) - 0.5) * ScreenSize;
+		/*double dx = 2.0 * (sampler.Next1D() - 0.5) * ScreenSize;
+		double dy = 2.0 * (sampler.Next1D() - 0.5) * ScreenSize;
 		Vec2 p{ dx, dy };
 		pdf = 0.25;
 		return PointSource{ p, Source(p) };*/
 		
-		int i = Rand01(gen) * m_PointSources.size();
+		int i = sampler.Next1D() * m_PointSources.size();
 		PointSource s = m_PointSources[i];
 		pdf = 1 / m_PointSources.size();
 		return s;
@@ -98,17 +89,18 @@ public:
 		return { intensity * R, 0., intensity * B};
 	}
 
-	Vec3 IntegrateSphere(const Vec2& p, const double& r, std::mt19937& gen) const override
+	Vec3 IntegrateSphere(const Vec2& p, const double& r, Sampler& sampler) const override
 	{
 		Vec3 ans = {0.0, 0.0, 0.0};
+		GreenKernel kernel(r);
 		for (auto& v : m_PointSources) {
-			double l = (p - v.pos).norm();
-			if (l < r) {
-				ans += Green(r, l) * v.source;
+			double l2 = (p - v.pos).squaredNorm();
+			if (l2 < r * r) {
+				ans += kernel(l2) * v.source;
 			}
 		}
 
-		/*SamplePoint source_point = SampleGreen(p, r, gen);
+		/*SamplePoint source_point = SampleGreen(p, r, sampler);
 		double pdf = source_point.pdf;
 		double l = (p - source_point.pos).norm();
 		auto v = Green(r, l) * Source(source_point.pos) / pdf;*/
@@ -179,9 +171,9 @@ public:
 	}
 
 	// This sample point source based on the energy of each sphere
-	PointSource SampleSource(std::mt19937& gen, double& pdf) const override
+	PointSource SampleSource(Sampler& sampler, double& pdf) const override
 	{
-		double sample_energy = Rand01(gen) * m_TotalEnergy;
+		double sample_energy = sampler.Next1D() * m_TotalEnergy;
 
 		int sample_source = 0;
 		while (true) {
@@ -194,7 +186,7 @@ public:
 		const double r_source = m_SphereSources[sample_source].r;
 		const Vec3& v_source = m_SphereSources[sample_source].source;
 
-		SamplePoint sample_p = Uniform_Ball(c_source, r_source, gen);
+		SamplePoint sample_p = Uniform_Ball(c_source, r_source, sampler);
 
 		pdf = ToGrey(v_source) / m_TotalEnergy;
 		PointSource ps{ sample_p.pos, m_SphereSources[sample_source].source };
@@ -202,10 +194,10 @@ public:
 	}
 
 	// Integrate sphere according to source sampling
-	Vec3 IntegrateSphere(const Vec2& p, const double& r, std::mt19937& gen) const override
+	Vec3 IntegrateSphere(const Vec2& p, const double& r, Sampler& sampler) const override
 	{
 		double pdf;
-		PointSource ps = SampleSource(p, r, pdf, gen);
+		PointSource ps = SampleSource(p, r, pdf, sampler);
 		if (pdf > 0.0) {
 			double g = 0.0;
 			double l = (ps.pos - p).norm();
@@ -218,7 +210,7 @@ public:
 	}
 
 private:
-	PointSource	SampleSource(const Vec2& c, const double& r, double& pdf, std::mt19937& gen) const
+	PointSource	SampleSource(const Vec2& c, const double& r, double& pdf, Sampler& sampler) const
 	{
 		const int N = m_SphereSources.size();
 		vector<double> IntersectArea(N, 0); // instead of area, using total energy
@@ -229,7 +221,7 @@ private:
 			totalArea += IntersectArea[i];
 		}
 
-		double sample_area = Rand01(gen) * totalArea;
+		double sample_area = sampler.Next1D() * totalArea;
 		// no intersection, just return a point outside the sphere
 		if (totalArea <= 0.0) { return { {c[0] + r, c[1] + r}, {0.0, 0.0, 0.0} }; }
 
@@ -245,9 +237,9 @@ private:
 
 		// Do rejection sampling
 		int i = 0;
-		SamplePoint p = Uniform_Ball(c_source, r_source, gen);
+		SamplePoint p = Uniform_Ball(c_source, r_source, sampler);
 		while ((p.pos - c).norm() > r) {
-			p = Uniform_Ball(c_source, r_source, gen);
+			p = Uniform_Ball(c_source, r_source, sampler);
 			i++;
 			if (i > 1000) { p.pdf = 0.0; break; } // The area is too small
 		}
@@ -295,14 +287,12 @@ public:
 	{
 
 		m_Energy = 0.0;
-		for (int i = 0; i < m_img.res; ++i) {
-			for (int j = 0; j < m_img.res; ++j) {
-				if (ToGrey(m_img.buffer[i][j]) >= 0.8)
-				{
-					//m_img.buffer[i][j] = { 0.0, 0.0, 0.0 };
-				}
-				m_Energy += ToGrey(m_img.buffer[i][j]);
+		for (int index = 0; index < m_img.PixelCount(); ++index) {
+			if (ToGrey(m_img.GetColor(index)) >= 0.8)
+			{
+				//m_img.SetColor(index, { 0.0, 0.0, 0.0 });
 			}
+			m_Energy += ToGrey(m_img.GetColor(index));
 		}
 		m_img.SaveImagePFM(WorkDirectory + "imageSource.pfm");
 	}
@@ -317,45 +307,33 @@ public:
 	}
 
 	// This sample point source based on the energy of each sphere
-	PointSource SampleSource(std::mt19937& gen, double& pdf) const override
+	PointSource SampleSource(Sampler& sampler, double& pdf) const override
 	{
-		double e = Rand01(gen) * m_Energy;
+		double e = sampler.Next1D() * m_Energy;
 		
 		PointSource ps;
-		for (int i = 0; i < m_img.res; ++i) {
-			for (int j = 0; j < m_img.res; ++j) {
-				e -= ToGrey(m_img.buffer[i][j]);
-				if (e < 0)
-				{
-					pdf = ToGrey(m_img.buffer[i][j]) / m_Energy;
-					ps.pos = m_img.img2world({i, j});
-					ps.source = m_img.buffer[i][j];
-					break;
-				}
-				
+		for (int index = 0; index < m_img.PixelCount(); ++index) {
+			Vec3 c = m_img.GetColor(index);
+			e -= ToGrey(c);
+			if (e < 0)
+			{
+				pdf = ToGrey(c) / m_Energy;
+				ps.pos = m_img.img2world(m_img.PixelCoord(index));
+				ps.source = c;
+				break;
 			}
 		}
 		return ps;
 	}
 
 	// Integrate sphere according to source sampling
-	Vec3 IntegrateSphere(const Vec2& pos, const double& r, std::mt19937& gen) const override
+	Vec3 IntegrateSphere(const Vec2& pos, const double& r, Sampler& sampler) const override
 	{
-		Vec2i coor = m_img.world2img(pos);
 		Vec3 ans{ 0.0, 0.0, 0.0 };
-		int pixel_r = int(r / m_img.pixel_size + 1);
-		for (int x = coor[0] - pixel_r; x <= coor[0] + pixel_r; ++x) {
-			for (int y = coor[1] - pixel_r; y <= coor[1] + pixel_r; ++y) {
-				Vec2 p = m_img.img2world({ x, y });
-				Vec3 source = m_img.buffer[x][y];
-				double l = (p - pos).norm();
-				if (l > r) {
-					continue;
-				}
-				double g = Green(r, l);
-				ans += g * source;
-			}
-		}
+		GreenKernel kernel(r / m_img.pixel_size);
+		m_img.ForEachDiskPixel(pos, r, { 0.0, 0.0 }, [&](int index, double l2) {
+			ans += kernel(l2) * m_img.GetColor(index);
+		});
 		return ans;
 	}
 
@@ -0,0 +1,87 @@
+#pragma once
+#include "Common.h"
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+
+// Long-lived worker threads running submitted tasks in submission order. Solvers share
+// one pool across batches and phases instead of starting and joining threads per batch.
+// A task must not wait for another task of the same pool, that can deadlock.
+class ThreadPool
+{
+public:
+	explicit ThreadPool(int threads)
+	{
+		for (int i = 0; i < max(1, threads); ++i) {
+			workers.emplace_back([this] { Work(); });
+		}
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Finishes the queued tasks before the workers exit
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& w : workers) { w.join(); }
+	}
+
+	int Size() const { return (int)workers.size(); }
+
+	// Queue f(), the future reports when it finished and rethrows what it threw
+	template <typename F>
+	std::future<void> Submit(F f)
+	{
+		auto task = std::make_shared<std::packaged_task<void()>>(std::move(f));
+		std::future<void> done = task->get_future();
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			tasks.push([task] { (*task)(); });
+		}
+		wake.notify_one();
+		return done;
+	}
+
+	// Run f(i) for every i in [0, count) on the pool and wait for all of them
+	template <typename F>
+	void Run(int count, F f)
+	{
+		std::vector<std::future<void>> done;
+		for (int i = 0; i < count; ++i) {
+			done.push_back(Submit([&f, i] { f(i); }));
+		}
+		// Every task refers to f, so all of them have to end before an exception leaves
+		for (auto& d : done) { d.wait(); }
+		for (auto& d : done) { d.get(); }
+	}
+
+private:
+	void Work()
+	{
+		while (true) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [this] { return stopping || !tasks.empty(); });
+				if (tasks.empty()) { return; }
+				task = std::move(tasks.front());
+				tasks.pop();
+			}
+			task();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()>> tasks;
+	std::mutex lock;
+	std::condition_variable wake;
+	bool stopping = false;
+};
@@ -0,0 +1,104 @@
+#pragma once
+#include "Common.h"
+#include "Boundary.h"
+#include <memory>
+
+// W walks advanced in lockstep, one lane each, for W = 4, 8 or 16. Every step runs over all lanes
+// under a mask of the live ones: closest points, termination, the work of the estimator, the
+// direction and the move. A lane whose walk ends is refilled from the walk queue right away, so
+// the packet stays full until the queue runs dry. Same interface and same walks as WavefrontWalks::Run.
+//
+// Only the termination tests and the moves are plain loops over the W lanes that the compiler can
+// keep in vector registers (a packet of doubles fills an AVX2, AVX-512 or two AVX-512 registers)
+// with masked blends. The closest point, direction and visit loops are scalar, one lane after the
+// other: closest points are one fcpw query per lane, with the WalkQueryContext of the lane as in
+// the scalar walks, since fcpw is vectorized over the children of its BVH nodes and the segments
+// of its leaves, not over query points. The estimator's work (source integration, splats) and cos
+// and sin also stay per lane, the latter so the walks do not change. The scalar loops dominate a
+// step, so packets are not reliably faster than single walks (RunWavefrontBenchmark).
+//
+// The lanes start zeroed, so the blends never read values no walk wrote.
+template <int W>
+class WalkPacket
+{
+	static_assert(W == 4 || W == 8 || W == 16, "packets of 4, 8 or 16 walks");
+
+public:
+	explicit WalkPacket(SamplerType type)
+	{
+		for (auto& sampler : samplers) { sampler = MakeSampler(type); }
+	}
+
+	template <typename Next, typename Start, typename Visit, typename Finish>
+	void Run(const Boundary& boundary, int maxSteps, double epsilon, double far,
+			 Next next, Start start, Visit visit, Finish finish)
+	{
+		bool drained = false;
+		auto refill = [&](int k) {
+			while (!drained) {
+				int walk;
+				if (!next(walk)) {
+					drained = true;
+					break;
+				}
+				Vec2 pos;
+				if (!start(walk, *samplers[k], pos, value[k], weight[k])) { continue; }
+				x[k] = pos[0];
+				y[k] = pos[1];
+				origin[k] = pos;
+				contexts[k].Reset();
+				steps[k] = 0;
+				walks[k] = walk;
+				return true;
+			}
+			return false;
+		};
+
+		int live = 0;
+		for (int k = 0; k < W; ++k) {
+			active[k] = refill(k);
+			live += active[k];
+		}
+
+		while (live > 0) {
+			for (int k = 0; k < W; ++k) {
+				if (active[k]) { r[k] = boundary.GetClosestPoint(Vec2(x[k], y[k]), contexts[k]).distance; }
+			}
+
+			for (int k = 0; k < W; ++k) {
+				done[k] = active[k] & ((r[k] < epsilon) | (r[k] > far));
+				moving[k] = active[k] & !done[k];
+			}
+
+			for (int k = 0; k < W; ++k) {
+				if (moving[k]) {
+					visit(Vec2(x[k], y[k]), r[k], weight[k], value[k], *samplers[k]);
+					double theta = TwoPI * samplers[k]->Next1D();
+					c[k] = cos(theta);
+					s[k] = sin(theta);
+				}
+			}
+
+			for (int k = 0; k < W; ++k) {
+				x[k] = moving[k] ? x[k] + r[k] * c[k] : x[k];
+				y[k] = moving[k] ? y[k] + r[k] * s[k] : y[k];
+				steps[k] += moving[k];
+			}
+
+			for (int k = 0; k < W; ++k) {
+				if (!done[k] && !(moving[k] && steps[k] == maxSteps)) { continue; }
+				finish(walks[k], origin[k], Vec2(x[k], y[k]), value[k], (bool)done[k]);
+				active[k] = refill(k);
+				live -= !active[k];
+			}
+		}
+	}
+
+private:
+	alignas(64) double x[W] = {}, y[W] = {}, r[W] = {}, c[W] = {}, s[W] = {}, weight[W] = {};
+	alignas(64) int steps[W] = {}, walks[W] = {}, active[W] = {}, done[W] = {}, moving[W] = {};
+	Vec2 origin[W];
+	Vec3 value[W];
+	WalkQueryContext contexts[W];
+	std::unique_ptr<Sampler> samplers[W];
+};
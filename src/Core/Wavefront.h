@@ -0,0 +1,164 @@
+#pragma once
+#include "Common.h"
+#include "Boundary.h"
+#include <algorithm>
+#include <memory>
+
+// Wavefront walk on spheres: up to width walks are in flight at once, their state kept in
+// arrays per field, and every round runs one stage over all live walks before the next:
+//  1. closest point queries of the whole batch, issued in Morton order of the positions so
+//     consecutive queries walk the same BVH nodes and segments (Boundary::GetClosestDistances)
+//  2. termination, r < epsilon or r > far
+//  3. the work of the estimator (visit), also in Morton order so splats of consecutive walks
+//     land on nearby pixels
+//  4. the step to a uniform point of the sphere, the directions drawn first and the positions
+//     then moved in a plain loop over the arrays
+// Walks that terminated or made maxSteps steps are finished and compacted away, and the free
+// lanes are refilled from the walk queue. Every lane owns a sampler that is restarted per
+// walk, so a walk draws the same dimensions in the same order as the scalar loop and the
+// results only differ from it in the order they are summed.
+class WavefrontWalks
+{
+public:
+	WavefrontWalks(SamplerType type, int width)
+		: width(max(1, width)), x(this->width), y(this->width), r(this->width), weight(this->width),
+		  theta(this->width), value(this->width), steps(this->width), walks(this->width),
+		  done(this->width), origin(this->width), codes(this->width), order(this->width), scratch(this->width), query(this->width),
+		  distances(this->width), samplers(this->width)
+	{
+		for (auto& sampler : samplers) { sampler = MakeSampler(type); }
+	}
+
+	// Runs every walk next hands out until it returns false:
+	//   next(int& walk)                                      the index of the next walk
+	//   start(walk, sampler, Vec2& pos, Vec3& v, double& w)  restart sampler and set the start
+	//                                                        and the value, false skips the walk
+	//   visit(pos, r, w, Vec3& v, sampler)                   a step from pos that did not terminate
+	//   finish(walk, start, pos, Vec3& v, bool terminated)   the start and the last position, terminated
+	//                                                        is false after maxSteps steps without terminating
+	template <typename Next, typename Start, typename Visit, typename Finish>
+	void Run(const Boundary& boundary, int maxSteps, double epsilon, double far,
+			 Next next, Start start, Visit visit, Finish finish)
+	{
+		int live = 0;
+		bool drained = false;
+		for (;;) {
+			while (live < width && !drained) {
+				int walk;
+				if (!next(walk)) {
+					drained = true;
+					break;
+				}
+				Vec2 pos;
+				if (!start(walk, *samplers[live], pos, value[live], weight[live])) { continue; }
+				x[live] = pos[0];
+				y[live] = pos[1];
+				origin[live] = pos;
+				steps[live] = 0;
+				walks[live] = walk;
+				++live;
+			}
+			if (live == 0) { return; }
+
+			SortLanes(live);
+			for (int k = 0; k < live; ++k) { query[k] = Vec2(x[order[k]], y[order[k]]); }
+			boundary.GetClosestDistances(query.data(), live, distances.data());
+			for (int k = 0; k < live; ++k) { r[order[k]] = distances[k]; }
+
+			for (int l = 0; l < live; ++l) { done[l] = r[l] < epsilon || r[l] > far; }
+
+			for (int k = 0; k < live; ++k) {
+				int l = order[k];
+				if (!done[l]) { visit(Vec2(x[l], y[l]), r[l], weight[l], value[l], *samplers[l]); }
+			}
+
+			for (int l = 0; l < live; ++l) {
+				if (!done[l]) { theta[l] = TwoPI * samplers[l]->Next1D(); }
+			}
+			for (int l = 0; l < live; ++l) {
+				if (done[l]) { continue; }
+				x[l] += r[l] * cos(theta[l]);
+				y[l] += r[l] * sin(theta[l]);
+				++steps[l];
+			}
+
+			for (int l = 0; l < live;) {
+				if (!done[l] && steps[l] < maxSteps) {
+					++l;
+					continue;
+				}
+				finish(walks[l], origin[l], Vec2(x[l], y[l]), value[l], (bool)done[l]);
+				MoveLane(--live, l);
+			}
+		}
+	}
+
+private:
+	// 8 bits of each coordinate over [-2, 2] ScreenSize interleaved, nearby walks get nearby codes.
+	// Walks further out share the cells of the border.
+	static inline uint32_t Morton(double px, double py)
+	{
+		auto quantize = [](double c) {
+			double u = (c / ScreenSize + 2.0) * (256.0 / 4.0);
+			return (uint32_t)min(255.0, max(0.0, u));
+		};
+		auto spread = [](uint32_t v) {
+			v = (v | (v << 4)) & 0x0F0Fu;
+			v = (v | (v << 2)) & 0x3333u;
+			v = (v | (v << 1)) & 0x5555u;
+			return v;
+		};
+		return spread(quantize(px)) | (spread(quantize(py)) << 1);
+	}
+
+	// order gets the live lanes sorted by Morton code, a radix sort of a byte per pass
+	void SortLanes(int live)
+	{
+		for (int l = 0; l < live; ++l) { codes[l] = Morton(x[l], y[l]); }
+		int count[256];
+		for (int pass = 0; pass < 2; ++pass) {
+			const int shift = 8 * pass;
+			const int* from = pass == 0 ? nullptr : scratch.data();
+			int* to = pass == 0 ? scratch.data() : order.data();
+			std::fill(count, count + 256, 0);
+			for (int k = 0; k < live; ++k) { ++count[(codes[from ? from[k] : k] >> shift) & 255]; }
+			for (int b = 0, sum = 0; b < 256; ++b) {
+				int c = count[b];
+				count[b] = sum;
+				sum += c;
+			}
+			for (int k = 0; k < live; ++k) {
+				int l = from ? from[k] : k;
+				to[count[(codes[l] >> shift) & 255]++] = l;
+			}
+		}
+	}
+
+	void MoveLane(int from, int to)
+	{
+		if (from == to) { return; }
+		x[to] = x[from];
+		y[to] = y[from];
+		origin[to] = origin[from];
+		weight[to] = weight[from];
+		value[to] = value[from];
+		steps[to] = steps[from];
+		walks[to] = walks[from];
+		done[to] = done[from];
+		std::swap(samplers[to], samplers[from]);
+	}
+
+	int width;
+	std::vector<double> x, y, r, weight, theta;
+	std::vector<Vec3> value;
+	std::vector<int> steps, walks;
+	std::vector<char> done;
+	std::vector<Vec2> origin;
+
+	std::vector<uint32_t> codes;
+	std::vector<int> order, scratch;
+	std::vector<Vec2> query;
+	std::vector<double> distances;
+
+	std::vector<std::unique_ptr<Sampler>> samplers;
+};
@@ -0,0 +1,93 @@
+#pragma once
+#include "Common.h"
+#include "ThreadPool.h"
+#include <atomic>
+#include <deque>
+#include <mutex>
+
+// Runs f(item) for the items 0..count-1 on the workers of a pool. Every worker starts with
+// a contiguous share in its own queue and works through it from the front. Once it runs dry
+// it steals from the back of the others, the items their owners would reach last, so a few
+// expensive items do not leave the other workers idle. Items must not depend on each other.
+class WorkStealingScheduler
+{
+public:
+	template <typename F>
+	static void Run(ThreadPool& pool, int count, F f)
+	{
+		int workers = min(pool.Size(), max(1, count));
+		std::vector<WorkQueue> queues(workers);
+		for (int w = 0; w < workers; ++w) {
+			int begin = int((long long)count * w / workers);
+			int end = int((long long)count * (w + 1) / workers);
+			for (int item = begin; item < end; ++item) { queues[w].items.push_back(item); }
+		}
+
+		pool.Run(workers, [&](int w) {
+			int item;
+			while (Pop(queues[w], item) || Steal(queues, w, item)) {
+				f(item);
+			}
+		});
+	}
+
+private:
+	struct WorkQueue
+	{
+		std::mutex lock;
+		std::deque<int> items;
+	};
+
+	static bool Pop(WorkQueue& queue, int& item)
+	{
+		std::lock_guard<std::mutex> guard(queue.lock);
+		if (queue.items.empty()) { return false; }
+		item = queue.items.front();
+		queue.items.pop_front();
+		return true;
+	}
+
+	// Nothing new is queued while running, so failing to steal from every other queue ends the worker
+	static bool Steal(std::vector<WorkQueue>& queues, int thief, int& item)
+	{
+		int n = (int)queues.size();
+		for (int k = 1; k < n; ++k) {
+			WorkQueue& victim = queues[(thief + k) % n];
+			std::lock_guard<std::mutex> guard(victim.lock);
+			if (victim.items.empty()) { continue; }
+			item = victim.items.back();
+			victim.items.pop_back();
+			return true;
+		}
+		return false;
+	}
+};
+
+// Hands out the items 0..total-1 in ranges of chunk items to whichever thread asks next,
+// so threads that got short work come back for more instead of idling
+class ChunkCounter
+{
+public:
+	void Reset(int total, int chunk)
+	{
+		this->total = total;
+		this->chunk = max(1, chunk);
+		next = 0;
+	}
+
+	int ChunkCount() const { return (total + chunk - 1) / chunk; }
+
+	// The next range [begin, end), false once every item is handed out
+	bool Next(int& begin, int& end)
+	{
+		begin = next.fetch_add(chunk);
+		if (begin >= total) { return false; }
+		end = min(total, begin + chunk);
+		return true;
+	}
+
+private:
+	std::atomic<int> next{ 0 };
+	int total = 0;
+	int chunk = 1;
+};
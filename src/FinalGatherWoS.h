@@ -8,33 +8,42 @@ public:
 
 	void Solve(const PoissonEquation& equation, ImageBuffer* buffer, int id) override
 	{
-		ImageBuffer reverseResult(*buffer);
-		std::mt19937 gen(GetThreadSeed(id));
+		// Private to this thread even when buffer is shared by all threads
+		ImageBuffer reverseResult(buffer->window, buffer->layout);
+		InitBuffer(reverseResult);
+		const uint64_t key = GetThreadSeed(id);
+		auto sampler = MakeSampler();
 
 		// First run the reverse WoS and store directly into an image
 		if (equation.Boundary->HasBoundaryValue())
 		{
 			for (int sample = 0; sample < BoundarySamples; ++sample)
 			{
-				BoundarySinglePoint(equation, &reverseResult, gen);
+				sampler->StartWalk(key, WalkIndex(BoundaryWalks, sample));
+				BoundarySinglePoint(equation, &reverseResult, *sampler);
 			}
 		}
 
 		if (equation.Source->HasSource()) {
 			for (int sample = 0; sample < SourceSamples; ++sample)
 			{
-				SourceSinglePoint(equation, &reverseResult, gen);
+				sampler->StartWalk(key, WalkIndex(SourceWalks, sample));
+				SourceSinglePoint(equation, &reverseResult, *sampler);
 			}
 		}
+		reverseResult.ResolveSplats();
 
-		// Run forward pass
-		for (int i = 0; i < buffer->res; ++i) {
-			for (int j = 0; j < buffer->res; ++j) {
+		// Run forward pass, the walk groups of the pixels come after the reverse ones
+		for (int i = 0; i < buffer->width; ++i) {
+			for (int j = 0; j < buffer->height; ++j) {
+				if (!buffer->window.Wanted(i, j)) { continue; }
 				for (int sample = 0; sample < forward_PixelSamples; ++sample) {
+					sampler->StartWalk(key, WalkIndex(BoundaryWalks + 1 + j * buffer->width + i, sample));
 					Vec2 pos = buffer->img2world({ i, j });
 #ifdef UniformInPixel
-					double dx = (Rand01(gen) - 0.5) * buffer->pixel_size;
-					double dy = (Rand01(gen) - 0.5) * buffer->pixel_size;
+					Vec2 u = sampler->Next2D();
+					double dx = (u[0] - 0.5) * buffer->pixel_size;
+					double dy = (u[1] - 0.5) * buffer->pixel_size;
 					pos = pos + Vec2{ dx, dy };
 #endif // UniformInPixel
 
@@ -43,15 +52,21 @@ public:
 							continue;
 						}
 					}
-					FinalGather(pos, equation, buffer, reverseResult, gen);
+					FinalGather(pos, equation, buffer, reverseResult, *sampler);
 				}
 			}
 		}
 	}
 
+	void WriteSettings(std::ostream& out) const override
+	{
+		ReverseWoSSolver::WriteSettings(out);
+		WriteBinary(out, forward_PixelSamples);
+	}
+
 	// Choose what rules to use in the forward walk
 	virtual void FinalGather(const Vec2& pixel_pos, const PoissonEquation& equation,
-		ImageBuffer* buffer, const ImageBuffer& reverseResult, std::mt19937& gen) = 0;
+		ImageBuffer* buffer, const ImageBuffer& reverseResult, Sampler& sampler) = 0;
 };
 
 
@@ -62,8 +77,14 @@ public:
 
 	string GetName() override { return "finalGather"; }
 
+	void WriteSettings(std::ostream& out) const override
+	{
+		FinalGatherSolver::WriteSettings(out);
+		WriteBinary(out, LookUpThreshold);
+	}
+
 	void FinalGather(const Vec2& pixel_pos, const PoissonEquation& equation,
-		ImageBuffer* buffer, const ImageBuffer& reverseResult, std::mt19937& gen) override
+		ImageBuffer* buffer, const ImageBuffer& reverseResult, Sampler& sampler) override
 	{
 		Vec2 p = pixel_pos;
 		ptrSourceTerm source = equation.Source;
@@ -93,10 +114,10 @@ public:
 
 			if (source->HasSource())
 			{
-				v += source->IntegrateSphere(p, r, gen);
+				v += source->IntegrateSphere(p, r, sampler);
 			}
 
-			SamplePoint sp = Uniform_dB(p, r, gen);
+			SamplePoint sp = Uniform_dB(p, r, sampler);
 			p = sp.pos;
 		}
 
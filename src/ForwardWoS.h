@@ -8,81 +8,377 @@ public:
 	int PixelSamples = 1;
 	bool ImportanceSampleSource = true;
 
+	// Adaptive sampling (SolveAdaptive): a pilot pass of PilotSamples walks per pixel estimates
+	// the standard deviation of a walk, then AdaptiveSamples - PilotSamples walks per pixel on
+	// average are spread in proportion to it, which minimizes the summed variance of the pixels.
+	// The deviation of a pixel is taken from its 8 neighbours only, so its walk count does not
+	// depend on its own pilot walks and averaging all of its walks stays unbiased.
+	int PilotSamples = 4;
+	int AdaptiveSamples = 16;
+
 	string GetName() override { 
 		return "ForwardWoS";
 	}
 
 	void Solve(const PoissonEquation& equation, ImageBuffer* buffer, int id) override
 	{
-		std::mt19937 gen(GetThreadSeed(id));
-		for (int i = 0; i < buffer->res; ++i) {
-			for (int j = 0; j < buffer->res; ++j) {
-			
-				// Ignore the pixel extirly outside the domain
-				if(equation.InteriorOnly()){
-					Vec2 pos = buffer->img2world({ i, j });
-					ClosePoint cp = equation.Boundary->GetClosestPoint(pos);
-					if (!equation.Boundary->CheckInterior(pos) && cp.distance > 2.0 * buffer->pixel_size)
-					{
-						continue;
-					}
+		const uint64_t key = GetThreadSeed(id);
+		if (BatchedWalks()) {
+			std::vector<int> pixels;
+			for (int i = 0; i < buffer->width; ++i) {
+				for (int j = 0; j < buffer->height; ++j) {
+					if (PixelWanted(equation, *buffer, i, j)) { pixels.push_back(j * buffer->width + i); }
 				}
+			}
+			SamplePixelsBatched(equation, *buffer, pixels, key, 0, PixelSamples, [&](int pixel, const Vec2& pos, const Vec3& v) {
+				buffer->WritePixel(pos, v / PixelSamples);
+			});
+			return;
+		}
+
+		auto sampler = MakeSampler();
+		for (int i = 0; i < buffer->width; ++i) {
+			for (int j = 0; j < buffer->height; ++j) {
+				SamplePixel(equation, *buffer, i, j, *sampler, key, 0, PixelSamples, [&](const Vec2& pos, const Vec3& v) {
+					buffer->WritePixel(pos, v / PixelSamples);
+				});
+			}
+		}
+	}
+
+	void WriteSettings(std::ostream& out) const override
+	{
+		Solver::WriteSettings(out);
+		WriteBinary(out, PixelSamples);
+		WriteBinary(out, ImportanceSampleSource);
+	}
+
+	bool SupportsTiles() const override { return true; }
+
+	// The estimate of a tile is summed locally and added to the image in one go
+	void SolveTile(const PoissonEquation& equation, ImageBuffer* buffer, int tile, int id) override
+	{
+		const uint64_t key = GetThreadSeed(id);
+		auto sampler = MakeSampler();
+		const int size = ImageBuffer::TileSize;
+		int x0, y0, x1, y1;
+		TileBounds(*buffer, tile, x0, y0, x1, y1);
+
+		Vec3 color[ImageBuffer::TilePixels];
+		int walks[ImageBuffer::TilePixels] = {};
+		if (BatchedWalks()) {
+			std::vector<int> pixels;
+			for (int i = x0; i < x1; ++i) {
+				for (int j = y0; j < y1; ++j) {
+					color[(j - y0) * size + i - x0] = Vec3(0.0, 0.0, 0.0);
+					if (PixelWanted(equation, *buffer, i, j)) { pixels.push_back(j * buffer->width + i); }
+				}
+			}
+			SamplePixelsBatched(equation, *buffer, pixels, key, 0, PixelSamples, [&](int pixel, const Vec2& pos, const Vec3& v) {
+				int local = (pixel / buffer->width - y0) * size + pixel % buffer->width - x0;
+				color[local] += v / PixelSamples;
+				++walks[local];
+			});
+		} else {
+			for (int i = x0; i < x1; ++i) {
+				for (int j = y0; j < y1; ++j) {
+					int local = (j - y0) * size + i - x0;
+					color[local] = Vec3(0.0, 0.0, 0.0);
+					SamplePixel(equation, *buffer, i, j, *sampler, key, 0, PixelSamples, [&](const Vec2& pos, const Vec3& v) {
+						color[local] += v / PixelSamples;
+						++walks[local];
+					});
+				}
+			}
+		}
+
+		TileGuard guard(buffer->GetTileLock(x0, y0));
+		for (int j = y0; j < y1; ++j) {
+			for (int i = x0; i < x1; ++i) {
+				int local = (j - y0) * size + i - x0;
+				if (walks[local] == 0) { continue; }
+				ImageBuffer::Accumulate(buffer->PixelData(buffer->PixelIndex(i, j)), color[local], 1.0, walks[local]);
+			}
+		}
+		CountTileEstimate(tile);
+	}
+
+	// One image holding AdaptiveSamples walks per pixel on average, see PilotSamples.
+	// Saves the image and the number of walks each pixel got.
+	void SolveAdaptive(const PoissonEquation& equation, int numberThread)
+	{
+		string name = WorkDirectory + GetName();
+		ThreadPool& pool = GetPool(numberThread);
+		m_CurrentBatch = 0;
+
+		auto start = std::chrono::system_clock::now();
+		ImageBuffer img(m_Window, m_Layout);
+		std::vector<int> samples;
+		SampleAdaptive(equation, img, pool, samples);
+		std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+		std::cout << "Finish adaptive sampling, elapsed time: " << elapsed_seconds.count() << std::endl;
+
+		ImageBuffer samplesMap(m_Window);
+		for (int j = 0; j < img.height; ++j) {
+			for (int i = 0; i < img.width; ++i) {
+				double n = samples[j * img.width + i];
+				samplesMap.SetColor(samplesMap.PixelIndex(i, j), Vec3(n, n, n));
+			}
+		}
+		samplesMap.SaveImagePFM(name + "Samples.pfm");
+
+		std::stringstream s1;
+		s1 << std::fixed << std::setprecision(2) << elapsed_seconds.count();
+		img.SaveImagePFM(name + "Adaptive_Time" + s1.str() + "s.pfm");
+	}
+
+	// Adaptive sampling into img, samples gets the walks of every pixel (row major).
+	// Tiles are the work items of both passes.
+	void SampleAdaptive(const PoissonEquation& equation, ImageBuffer& img, ThreadPool& pool, std::vector<int>& samples)
+	{
+		const int width = img.width, height = img.height, tiles = img.tiles_x * img.tiles_y;
+
+		// Pilot, standard deviation of a walk averaged over the channels. Skipped pixels stay at -1
+		std::vector<double> sigma(width * height, -1.0);
+		std::vector<Vec3> pilot(width * height, Vec3(0.0, 0.0, 0.0));
+		std::vector<int> pilotWalks(width * height, 0);
+		const uint64_t key = GetThreadSeed(0);
+		WorkStealingScheduler::Run(pool, tiles, [&](int tile) {
+			auto sampler = MakeSampler();
+			int x0, y0, x1, y1;
+			TileBounds(img, tile, x0, y0, x1, y1);
+			for (int i = x0; i < x1; ++i) {
+				for (int j = y0; j < y1; ++j) {
+					Vec3 sum(0.0, 0.0, 0.0), sum2(0.0, 0.0, 0.0);
+					bool sampled = SamplePixel(equation, img, i, j, *sampler, key, 0, PilotSamples, [&](const Vec2& pos, const Vec3& v) {
+						sum += v;
+						sum2 += v.cwiseProduct(v);
+						++pilotWalks[j * width + i];
+					});
+					if (!sampled) { continue; }
+					pilot[j * width + i] = sum;
+					Vec3 mean = sum / PilotSamples;
+					Vec3 var = (sum2 - PilotSamples * mean.cwiseProduct(mean)) / max(1, PilotSamples - 1);
+					sigma[j * width + i] = sqrt(max(0.0, var.mean()));
+				}
+			}
+		});
+
+		// Deviation from the sampled neighbours, which also smooths the noise of a few pilot walks.
+		// Pixels without sampled neighbours keep their pilot walks.
+		auto forNeighbours = [&](int i, int j, auto f) {
+			for (int y = max(0, j - 1); y <= min(height - 1, j + 1); ++y) {
+				for (int x = max(0, i - 1); x <= min(width - 1, i + 1); ++x) {
+					if ((x != i || y != j) && sigma[y * width + x] >= 0.0) { f(y * width + x); }
+				}
+			}
+		};
+		std::vector<double> smooth(width * height, 0.0);
+		std::vector<int> neighbours(width * height, 0);
+		double total = 0.0;
+		int active = 0;
+		for (int j = 0; j < height; ++j) {
+			for (int i = 0; i < width; ++i) {
+				int p = j * width + i;
+				if (sigma[p] < 0.0) { continue; }
+				double sum = 0.0;
+				forNeighbours(i, j, [&](int q) {
+					sum += sigma[q];
+					++neighbours[p];
+				});
+				smooth[p] = neighbours[p] > 0 ? sum / neighbours[p] : 0.0;
+				total += smooth[p];
+				++active;
+			}
+		}
 
-				for (int sample = 0; sample < PixelSamples; ++sample) {
-					Vec2 pos = buffer->img2world({ i, j });
+		// The share of a pixel is normalized by the total without the terms of its own
+		// deviation, so no part of its walk count depends on its pilot
+		double budget = double(AdaptiveSamples - PilotSamples) * active;
+		samples.assign(width * height, 0);
+		for (int j = 0; j < height; ++j) {
+			for (int i = 0; i < width; ++i) {
+				int p = j * width + i;
+				if (sigma[p] < 0.0) { continue; }
+				double others = total;
+				forNeighbours(i, j, [&](int q) { others -= sigma[p] / neighbours[q]; });
+				double share = others > 0.0 ? smooth[p] / others : 1.0 / active;
+				samples[p] = max(0, (int)std::lround(budget * share));
+			}
+		}
+
+		// Tiles are written by one item each, no locks needed. The walks of a pixel go on after its pilot walks.
+		WorkStealingScheduler::Run(pool, tiles, [&](int tile) {
+			auto sampler = MakeSampler();
+			int x0, y0, x1, y1;
+			TileBounds(img, tile, x0, y0, x1, y1);
+			for (int i = x0; i < x1; ++i) {
+				for (int j = y0; j < y1; ++j) {
+					int p = j * width + i;
+					if (sigma[p] < 0.0) { continue; }
+					Vec3 sum = pilot[p];
+					int walks = pilotWalks[p];
+					SamplePixel(equation, img, i, j, *sampler, key, PilotSamples, samples[p], [&](const Vec2& pos, const Vec3& v) {
+						sum += v;
+						++walks;
+					});
+					samples[p] += PilotSamples;
+					if (walks == 0) { continue; }
+					ImageBuffer::Accumulate(img.PixelData(img.PixelIndex(i, j)), sum, 1.0 / samples[p], walks);
+				}
+			}
+		});
+	}
+
+	// Pixel range [x0, x1) x [y0, y1) of a tile of the tile grid of buffer
+	static void TileBounds(const ImageBuffer& buffer, int tile, int& x0, int& y0, int& x1, int& y1)
+	{
+		x0 = (tile % buffer.tiles_x) * ImageBuffer::TileSize;
+		y0 = (tile / buffer.tiles_x) * ImageBuffer::TileSize;
+		x1 = min(x0 + ImageBuffer::TileSize, buffer.width);
+		y1 = min(y0 + ImageBuffer::TileSize, buffer.height);
+	}
+
+	// Run the walks first, ..., first + samples - 1 of pixel (i, j) under the stream key and pass the
+	// jittered start and the value of every walk that reached the boundary to found(pos, v).
+	// False for pixels that are skipped altogether.
+	template <typename F>
+	bool SamplePixel(const PoissonEquation& equation, const ImageBuffer& buffer, int i, int j, Sampler& sampler,
+					 uint64_t key, int first, int samples, F found)
+	{
+		if (!PixelWanted(equation, buffer, i, j)) { return false; }
+
+		for (int sample = first; sample < first + samples; ++sample) {
+			Vec2 pos;
+			if (!StartPixelWalk(equation, buffer, i, j, sampler, key, sample, pos)) { continue; }
+			Vec3 v;
+			if (WalkFrom(pos, equation, sampler, v)) { found(pos, v); }
+		}
+		return true;
+	}
+
+	// SamplePixel for every pixel of pixels (j * width + i, all wanted) on RunWalks,
+	// found(pixel, pos, v) for the walks that reached the boundary.
+	// The walks are the ones of SamplePixel, in another order.
+	template <typename F>
+	void SamplePixelsBatched(const PoissonEquation& equation, const ImageBuffer& buffer, const std::vector<int>& pixels,
+							   uint64_t key, int first, int samples, F found)
+	{
+		const int total = (int)pixels.size() * samples;
+		if (total == 0) { return; }
+		int next = 0;
+		RunWalks(*equation.Boundary, 5.0 * ScreenSize, total,
+			[&](int& walk) {
+				if (next == total) { return false; }
+				walk = next++;
+				return true;
+			},
+			[&](int walk, Sampler& sampler, Vec2& pos, Vec3& v, double& weight) {
+				int pixel = pixels[walk / samples];
+				v = Vec3{ 0.0, 0.0, 0.0 };
+				weight = 1.0;
+				return StartPixelWalk(equation, buffer, pixel % buffer.width, pixel / buffer.width, sampler, key, first + walk % samples, pos);
+			},
+			[&](const Vec2& p, double r, double weight, Vec3& v, Sampler& sampler) {
+				GatherSource(equation, p, r, sampler, v);
+			},
+			[&](int walk, const Vec2& start, const Vec2& p, Vec3& v, bool terminated) {
+				if (!terminated) { return; }
+				v += equation.Boundary->BoundaryValue(p);
+				found(pixels[walk / samples], start, v);
+			});
+	}
+
+	// False for pixels outside the mask of the window, which cost nothing, or entirely outside the domain
+	bool PixelWanted(const PoissonEquation& equation, const ImageBuffer& buffer, int i, int j) const
+	{
+		if (!buffer.window.Wanted(i, j)) { return false; }
+
+		// Ignore the pixel extirly outside the domain
+		if(equation.InteriorOnly()){
+			Vec2 pos = buffer.img2world({ i, j });
+			ClosePoint cp = equation.Boundary->GetClosestPoint(pos);
+			if (!equation.Boundary->CheckInterior(pos) && cp.distance > 2.0 * buffer.pixel_size)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Restart sampler at walk sample of pixel (i, j) and jitter its start pos, false if pos is outside the domain
+	bool StartPixelWalk(const PoissonEquation& equation, const ImageBuffer& buffer, int i, int j, Sampler& sampler,
+						uint64_t key, int sample, Vec2& pos) const
+	{
+		sampler.StartWalk(key, WalkIndex(j * buffer.width + i, sample));
+		pos = buffer.img2world({ i, j });
 #ifdef UniformInPixel
-					double dx = (Rand01(gen) - 0.5) * buffer->pixel_size;
-					double dy = (Rand01(gen) - 0.5) * buffer->pixel_size;
-					pos = pos + Vec2{ dx, dy };
+		Vec2 u = sampler.Next2D();
+		double dx = (u[0] - 0.5) * buffer.pixel_size;
+		double dy = (u[1] - 0.5) * buffer.pixel_size;
+		pos = pos + Vec2{ dx, dy };
 #endif // UniformInPixel 1;
 
-					if(equation.InteriorOnly()){
-						if (!equation.Boundary->CheckInterior(pos)) {
-							continue;
-						}
-					}
-					WoSSinglePoint(pos, equation, buffer, gen);
-				}
+		if(equation.InteriorOnly()){
+			if (!equation.Boundary->CheckInterior(pos)) {
+				return false;
 			}
 		}
+		return true;
 	}
 
 	void WoSSinglePoint(const Vec2& pixel_pos, const PoissonEquation& equation, 
-					    ImageBuffer* buffer, std::mt19937& gen)
+					    ImageBuffer* buffer, Sampler& sampler)
+	{
+		Vec3 v;
+		if (WalkFrom(pixel_pos, equation, sampler, v)) {
+			buffer->WritePixel(pixel_pos, v / PixelSamples);
+		}
+	}
+
+	// Walk on spheres from pixel_pos, v gets the boundary value plus the source gathered
+	// on the way. False if the walk did not reach the boundary within MaxPathLength steps.
+	bool WalkFrom(const Vec2& pixel_pos, const PoissonEquation& equation, Sampler& sampler, Vec3& v)
 	{
 		Vec2 p = pixel_pos;
-		ptrSourceTerm source = equation.Source;
 		ptrBoundary boundary = equation.Boundary;
 
-		Vec3 v{0.0, 0.0, 0.0};
+		v = Vec3{0.0, 0.0, 0.0};
 
+		WalkQueryContext context;
 		for (int i = 0; i < MaxPathLength; ++i)
 		{
-			ClosePoint cp = boundary->GetClosestPoint(p);
+			ClosePoint cp = boundary->GetClosestPoint(p, context);
 			double r = cp.distance;
 
 			if (r < m_Epsilon || r > 5.0 * ScreenSize)
 			{
 				v += boundary->BoundaryValue(p); // need to use p because we need the side of the boundary value
-				buffer->WritePixel(pixel_pos, v / PixelSamples);
-				
-				break;
+				return true;
 			}
 
-			if (source->HasSource())
-			{	
-				if(ImportanceSampleSource) {
-					v += source->IntegrateSphere(p, r, gen);
-				} else {
-					// Importance sample Green's function
-					SamplePoint source_point = SampleGreen(p, r, gen);
-					double pdf = source_point.pdf;
-					double l = (p - source_point.pos).norm();
-					v += Green(r, l) * source->Source(source_point.pos) / pdf;
-				}
-			}
-			SamplePoint sp = Uniform_dB(p, r, gen);
+			GatherSource(equation, p, r, sampler, v);
+			SamplePoint sp = Uniform_dB(p, r, sampler);
 			p = sp.pos;
 		}
+		return false;
+	}
+
+	// Add the source inside the sphere (p, r) of a walk step to v
+	void GatherSource(const PoissonEquation& equation, const Vec2& p, double r, Sampler& sampler, Vec3& v) const
+	{
+		ptrSourceTerm source = equation.Source;
+		if (source->HasSource())
+		{	
+			if(ImportanceSampleSource) {
+				v += source->IntegrateSphere(p, r, sampler);
+			} else {
+				// Importance sample Green's function
+				SamplePoint source_point = SampleGreen(p, r, sampler);
+				double pdf = source_point.pdf;
+				double l = (p - source_point.pos).norm();
+				v += Green(r, l) * source->Source(source_point.pos) / pdf;
+			}
+		}
 	}
 };
@@ -9,6 +9,21 @@ public:
 	int SourceSamples = 1e5;
 	int BoundarySamples = 1e5;
 
+	// The threads of a batch share SourceSamples and BoundarySamples instead of each running
+	// all of them, taking WalkChunk walks at a time until they are spent. The batch then costs
+	// the same for any thread count and the threads finish together. Every walk draws from its
+	// own stream, so the walks do not depend on which thread ran them or on WalkChunk.
+	bool SharedWalkBudget = false;
+	int WalkChunk = 64;
+
+	// Draw disks wider than 2 * MipSplatRadius pixels on a coarser pyramid level, 0 disables it
+	int MipSplatRadius = 0;
+
+	// Record disks of at least DeferredSplatRadius pixels and draw them per batch with FFT
+	// convolutions, binned by radius into DeferredBinsPerOctave bins per octave. 0 disables it
+	int DeferredSplatRadius = 0;
+	int DeferredBinsPerOctave = 4;
+
 	string GetName() override 
 	{ 
 		return "ReverseWoS";
@@ -16,13 +31,36 @@ public:
 
 	void Solve(const PoissonEquation& equation, ImageBuffer* buffer, int id) override
 	{
-		std::mt19937 gen(GetThreadSeed(id));
+		if (SharedWalkBudget) {
+			SolveChunks(equation, buffer);
+			return;
+		}
+		const uint64_t key = GetThreadSeed(id);
+		if (BatchedWalks()) {
+			int next = 0, total = SourceSamples;
+			auto walks = [&](int& walk) {
+				if (next == total) { return false; }
+				walk = next++;
+				return true;
+			};
+			if (equation.Source->HasSource()) {
+				RunBatched(equation, buffer, key, SourceWalks, SourceSamples, walks);
+			}
+			next = 0;
+			total = BoundarySamples;
+			if (equation.Boundary->HasBoundaryValue()) {
+				RunBatched(equation, buffer, key, BoundaryWalks, BoundarySamples, walks);
+			}
+			return;
+		}
+		auto sampler = MakeSampler();
 
 		// Handle the source term
 		if (equation.Source->HasSource()) {
 			for (int sample = 0; sample < SourceSamples; ++sample)
 			{
-				SourceSinglePoint(equation, buffer, gen);
+				sampler->StartWalk(key, WalkIndex(SourceWalks, sample));
+				SourceSinglePoint(equation, buffer, *sampler);
 			}
 		}
 
@@ -32,41 +70,184 @@ public:
 		{
 			for (int sample = 0; sample < BoundarySamples; ++sample)
 			{
-				BoundarySinglePoint(equation, buffer, gen);
+				sampler->StartWalk(key, WalkIndex(BoundaryWalks, sample));
+				BoundarySinglePoint(equation, buffer, *sampler);
 			}
+		}
+	}
 
-			if(Normalize_PoissonKernel) {
-				for (int i = 0; i < buffer->res; ++i) {
-					for (int j = 0; j < buffer->res; ++j) {
-						if (buffer->PoissonKernelNormalizer[i][j] != 0.0) {
-							buffer->buffer[i][j] /= buffer->PoissonKernelNormalizer[i][j];
-						}
-					}
+	// Source chunks are handed out before boundary chunks. The walks of the batch are
+	// the ones of estimate 0 of Solve, whatever thread runs a chunk.
+	void SolveChunks(const PoissonEquation& equation, ImageBuffer* buffer)
+	{
+		const uint64_t key = GetThreadSeed(0);
+		if (BatchedWalks()) {
+			// Lanes are refilled a chunk at a time
+			int begin = 0, end = 0;
+			ChunkCounter* counter = &m_SourceWalks;
+			auto walks = [&](int& walk) {
+				if (begin == end && !counter->Next(begin, end)) { return false; }
+				walk = begin++;
+				return true;
+			};
+			if (equation.Source->HasSource()) {
+				RunBatched(equation, buffer, key, SourceWalks, SourceSamples, walks);
+			}
+			begin = end = 0;
+			counter = &m_BoundaryWalks;
+			if (equation.Boundary->HasBoundaryValue()) {
+				RunBatched(equation, buffer, key, BoundaryWalks, BoundarySamples, walks);
+			}
+			return;
+		}
+		auto sampler = MakeSampler();
+		int begin, end;
+		if (equation.Source->HasSource()) {
+			while (m_SourceWalks.Next(begin, end)) {
+				for (int sample = begin; sample < end; ++sample) {
+					sampler->StartWalk(key, WalkIndex(SourceWalks, sample));
+					SourceSinglePoint(equation, buffer, *sampler);
 				}
 			}
+		}
+
+		if (equation.Boundary->HasBoundaryValue()) {
+			while (m_BoundaryWalks.Next(begin, end)) {
+				for (int sample = begin; sample < end; ++sample) {
+					sampler->StartWalk(key, WalkIndex(BoundaryWalks, sample));
+					BoundarySinglePoint(equation, buffer, *sampler);
+				}
+			}
+		}
+	}
+
+	void BeginBatch(int numberThread) override
+	{
+		m_SourceWalks.Reset(SourceSamples, WalkChunk);
+		m_BoundaryWalks.Reset(BoundarySamples, WalkChunk);
+	}
+
+	// The walks of a shared budget are normalized by the whole budget, so the threads of a batch add up to one estimate
+	double EstimatesPerBatch(int numberThread) override
+	{
+		return SharedWalkBudget ? 1.0 : Solver::EstimatesPerBatch(numberThread);
+	}
+
+	void WriteSettings(std::ostream& out) const override
+	{
+		Solver::WriteSettings(out);
+		WriteBinary(out, Normalize_PoissonKernel);
+		WriteBinary(out, SourceSamples);
+		WriteBinary(out, BoundarySamples);
+		WriteBinary(out, SharedWalkBudget);
+		WriteBinary(out, MipSplatRadius);
+		WriteBinary(out, DeferredSplatRadius);
+		WriteBinary(out, DeferredBinsPerOctave);
+	}
+
+	// A thread holds however many chunks it took, from none to all of them
+	bool ThreadsShareEstimate() const override { return SharedWalkBudget; }
+
+	void InitBuffer(ImageBuffer& buffer) override
+	{
+		if (MipSplatRadius > 0) {
+			buffer.EnableMipSplatting(MipSplatRadius);
+		}
+		if (DeferredSplatRadius > 0) {
+			buffer.EnableDeferredSplatting(DeferredSplatRadius, DeferredBinsPerOctave);
+		}
+	}
 
+	// Poisson kernel normalization runs once the walks of all threads sharing the image are done
+	void NormalizeBuffer(const PoissonEquation& equation, ImageBuffer& buffer, double estimateCount) override
+	{
+		if (Normalize_PoissonKernel && equation.Boundary->HasBoundaryValue()) {
+			NormalizeByPoissonKernel(&buffer);
+		} else {
+			Solver::NormalizeBuffer(equation, buffer, estimateCount);
 		}
 	}
 
-	void SourceSinglePoint(const PoissonEquation& equation, ImageBuffer* buffer, std::mt19937& gen);
+	void NormalizeByPoissonKernel(ImageBuffer* buffer)
+	{
+		buffer->ForEachStoredPixel([&](int index) {
+			double w = buffer->GetWeight(index);
+			if (w != 0.0) {
+				buffer->SetColor(index, buffer->GetColor(index) / w);
+			}
+		});
+	}
+
+	// Walk groups of WalkIndex
+	static constexpr int SourceWalks = 0;
+	static constexpr int BoundaryWalks = 1;
+
+	void SourceSinglePoint(const PoissonEquation& equation, ImageBuffer* buffer, Sampler& sampler);
+
+	void BoundarySinglePoint(const PoissonEquation& equation, ImageBuffer* buffer, Sampler& sampler);
 
-	void BoundarySinglePoint(const PoissonEquation& equation, ImageBuffer* buffer, std::mt19937& gen);
+	// Start of a walk: its position and the value it splats (the weight of the Poisson kernel estimate)
+	void StartSourceWalk(const PoissonEquation& equation, Sampler& sampler, Vec2& p, Vec3& v);
+
+	void StartBoundaryWalk(const PoissonEquation& equation, Sampler& sampler, Vec2& p, Vec3& v, double& weight);
+
+	// The walks of group (SourceWalks or BoundaryWalks) next hands out (at most count) on RunWalks
+	template <typename Next>
+	void RunBatched(const PoissonEquation& equation, ImageBuffer* buffer, uint64_t key, int group, int count, Next next)
+	{
+		auto finish = [](int walk, const Vec2& start, const Vec2& p, Vec3& v, bool terminated) {};
+		if (group == SourceWalks) {
+			RunWalks(*equation.Boundary, std::numeric_limits<double>::infinity(), count, next,
+				[&](int walk, Sampler& sampler, Vec2& p, Vec3& v, double& weight) {
+					sampler.StartWalk(key, WalkIndex(SourceWalks, walk));
+					StartSourceWalk(equation, sampler, p, v);
+					weight = 1.0;
+					return true;
+				},
+				[&](const Vec2& p, double r, double weight, Vec3& v, Sampler& sampler) {
+					buffer->DrawGreenSphere(p, r, v, sampler);
+				},
+				finish);
+		} else {
+			RunWalks(*equation.Boundary, 5.0 * ScreenSize, count, next,
+				[&](int walk, Sampler& sampler, Vec2& p, Vec3& v, double& weight) {
+					sampler.StartWalk(key, WalkIndex(BoundaryWalks, walk));
+					StartBoundaryWalk(equation, sampler, p, v, weight);
+					return true;
+				},
+				[&](const Vec2& p, double r, double weight, Vec3& v, Sampler& sampler) {
+					buffer->DrawGreenSphere(p, r, weight, v, sampler);
+				},
+				finish);
+		}
+	}
+
+private:
+	// Walk budgets of the current batch under SharedWalkBudget
+	ChunkCounter m_SourceWalks;
+	ChunkCounter m_BoundaryWalks;
 };
 
 
-void ReverseWoSSolver::SourceSinglePoint(const PoissonEquation& equation, ImageBuffer* buffer, std::mt19937& gen)
+void ReverseWoSSolver::StartSourceWalk(const PoissonEquation& equation, Sampler& sampler, Vec2& p, Vec3& v)
 {
-	ptrSourceTerm source = equation.Source;
-	ptrBoundary boundary = equation.Boundary;
-
 	double pdf;
-	PointSource pointsource = source->SampleSource(gen, pdf);
+	PointSource pointsource = equation.Source->SampleSource(sampler, pdf);
+	p = pointsource.pos;
+	v = pointsource.source / pdf / SourceSamples;
+}
+
+void ReverseWoSSolver::SourceSinglePoint(const PoissonEquation& equation, ImageBuffer* buffer, Sampler& sampler)
+{
+	ptrBoundary boundary = equation.Boundary;
 
-	Vec2 p = pointsource.pos;
-	Vec3 v = pointsource.source;
+	Vec2 p;
+	Vec3 v;
+	StartSourceWalk(equation, sampler, p, v);
+	WalkQueryContext context;
 	for (int i = 0; i < MaxPathLength; ++i)
 	{
-		ClosePoint cp = boundary->GetClosestPoint(p);
+		ClosePoint cp = boundary->GetClosestPoint(p, context);
 		double r = cp.distance;
 
 		if (r < m_Epsilon)
@@ -75,30 +256,26 @@ void ReverseWoSSolver::SourceSinglePoint(const PoissonEquation& equation, ImageB
 		}
 
 		// Reuse the same walk to all pixels by drawing the Green's disk
-		buffer->DrawGreenSphere(p, r, v / pdf / SourceSamples, gen);
+		buffer->DrawGreenSphere(p, r, v, sampler);
 
 
 		// Continue the walk
-		SamplePoint sp = Uniform_dB(p, r, gen);
+		SamplePoint sp = Uniform_dB(p, r, sampler);
 		p = sp.pos;
 	}
 }
 
-void ReverseWoSSolver::BoundarySinglePoint(const PoissonEquation& equation, ImageBuffer* buffer, std::mt19937& gen)
+void ReverseWoSSolver::StartBoundaryWalk(const PoissonEquation& equation, Sampler& sampler, Vec2& p, Vec3& v, double& weight)
 {
-	ptrSourceTerm source = equation.Source;
-	ptrBoundary boundary = equation.Boundary;
-
 	double pdf;
-	BoundaryVauleSample boundarysample = boundary->SampleBoundary(gen, pdf);
+	BoundaryVauleSample boundarysample = equation.Boundary->SampleBoundary(sampler, pdf);
 
 	Vec2 dp = m_Xi * boundarysample.normal;
-	Vec2 p;
 
 	if(equation.InteriorOnly()) {
 		p = boundarysample.pos - dp;
 	} else {
-		if (Rand01(gen) > 0.5) {
+		if (sampler.Next1D() > 0.5) {
 			p = boundarysample.pos + dp;
 		}
 		else {
@@ -106,10 +283,24 @@ void ReverseWoSSolver::BoundarySinglePoint(const PoissonEquation& equation, Imag
 		}
 	}
 
-	Vec3 v = boundarysample.bv;
+	v = boundarysample.bv;
+
+	// Divide Xi for the finite difference method
+	weight = 1.0 / pdf / (m_Xi * BoundarySamples);
+}
+
+void ReverseWoSSolver::BoundarySinglePoint(const PoissonEquation& equation, ImageBuffer* buffer, Sampler& sampler)
+{
+	ptrBoundary boundary = equation.Boundary;
+
+	Vec2 p;
+	Vec3 v;
+	double weight;
+	StartBoundaryWalk(equation, sampler, p, v, weight);
+	WalkQueryContext context;
 	for (int i = 0; i < MaxPathLength; ++i)
 	{ 
-		ClosePoint cp = boundary->GetClosestPoint(p);
+		ClosePoint cp = boundary->GetClosestPoint(p, context);
 		double r = cp.distance;
 
 		if (r < m_Epsilon || r > 5.0 * ScreenSize)
@@ -117,14 +308,11 @@ void ReverseWoSSolver::BoundarySinglePoint(const PoissonEquation& equation, Imag
 			break;
 		}
 
-		// Divide Xi for the finite difference method
-		double weight = 1.0 / pdf / (m_Xi * BoundarySamples);
-
 		// Reuse the same walk to all pixels by drawing the Green's disk
-		buffer->DrawGreenSphere(p, r, weight, v, gen);
+		buffer->DrawGreenSphere(p, r, weight, v, sampler);
 		
 		// Continue the walk
-		SamplePoint sp = Uniform_dB(p, r, gen);
+		SamplePoint sp = Uniform_dB(p, r, sampler);
 		p = sp.pos;
 	}
 }
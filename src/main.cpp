@@ -1,12 +1,15 @@
 #include "Core/Scene.h"
 #include "ReverseWoS.h"
 #include "ForwardWoS.h"
+#include "Benchmark.h"
 
-void RunSourceCompare(bool forward, int number_thread)
+void RunSourceCompare(bool forward, int number_thread, ThreadPool& pool)
 {
 	PoissonEquation equation = SourceScene();
 	ReverseWoSSolver reverseSolver;
 	ForwardWoSSolver forwardSolver;
+	reverseSolver.m_Pool = &pool;
+	forwardSolver.m_Pool = &pool;
 
 	reverseSolver.SourceSamples = 1e4;
 	forwardSolver.PixelSamples = 1;
@@ -16,16 +19,18 @@ void RunSourceCompare(bool forward, int number_thread)
 
 	if (forward) {
 		cout << "begin forward wos" << endl;
-		forwardSolver.SolveMultiThread(equation, number_thread);
+		forwardSolver.SolveMultiThread(equation, number_thread, 1, AccumulationMode::Tiles);
 	}
 }
 
 
-void RunBoundaryCompare(bool forward, int number_thread)
+void RunBoundaryCompare(bool forward, int number_thread, ThreadPool& pool)
 {
 	PoissonEquation equation = BoundaryScene(true);
 	ReverseWoSSolver reverseSolver;
 	ForwardWoSSolver forwardSolver;
+	reverseSolver.m_Pool = &pool;
+	forwardSolver.m_Pool = &pool;
 
 	reverseSolver.BoundarySamples = 2e5;
 	forwardSolver.PixelSamples = 1;
@@ -34,12 +39,25 @@ void RunBoundaryCompare(bool forward, int number_thread)
 	reverseSolver.SolveMultiThread(equation, number_thread);
 	if (forward) {
 		cout << "begin forward wos" << endl;
-		forwardSolver.SolveMultiThread(equation, number_thread);
+		forwardSolver.SolveMultiThread(equation, number_thread, 1, AccumulationMode::Tiles);
 	}
 }
 
-int main()
+// Usage: BidirectionalWoS [threads], all hardware threads by default. The pool size only sets
+// how fast the solves run, every batch has number_thread estimates on any machine.
+int main(int argc, char** argv)
 {
-	// RunSourceCompare(true, 16);
-	RunBoundaryCompare(true, 16);
+	const int number_thread = 16;
+	int pool_size = argc > 1 ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+	ThreadPool pool(pool_size > 0 ? pool_size : number_thread);
+
+	// RunGreenKernelBenchmark();
+	// RunPixelLayoutBenchmark();
+	// RunAdaptiveSamplingBenchmark();
+	// RunSamplerBenchmark();
+	// RunQMCBenchmark();
+	// RunWavefrontBenchmark();
+	// RunQueryContextBenchmark();
+	// RunSourceCompare(true, number_thread, pool);
+	RunBoundaryCompare(true, number_thread, pool);
 }
\ No newline at end of file